@@ -4,6 +4,9 @@ TOPDIR := $(dir $(lastword $(MAKEFILE_LIST)))
 # LibELI5 uses C++11 features.
 CXXFLAGS+=-std=c++14 -Wall -Wno-sign-compare
 
+# Flags (FlagsListener) and Diogenes use std::thread.
+CXXFLAGS+=-pthread
+
 # Link in logging library by default.
 LDFLAGS+=-L$(TOPDIR)lib
 LDFLAGS+=-Wl,-rpath,$(TOPDIR)lib
@@ -0,0 +1,107 @@
+// Tests of counting heap allocations. The Makefile builds this with
+// -DDIO_COUNT_ALLOCATIONS, which test_main.cc needs to count them.
+#include <memory>
+
+DIOTEST(Test_HookInstalled) = []() {
+  DioExpect(DioAllocations::hooked());
+};
+
+DIOTEST(Test_AllocationsCounted) = []() {
+  DioAllocations::Counts before = DioAllocations::ThisThread();
+  std::unique_ptr<int> one(new int(1));
+  std::unique_ptr<int[]> ten(new int[10]);
+  DioDoNotOptimize(one.get());
+  DioDoNotOptimize(ten.get());
+  DioAllocations::Counts after = DioAllocations::ThisThread();
+  DioExpect(after.allocations - before.allocations == 2);
+  DioExpect(after.bytes - before.bytes == 11 * sizeof(int));
+};
+
+// Counts are per thread, so tests running in parallel don't see each
+// other's allocations.
+DIOTEST(Test_AllocationsCountedPerThread) = []() {
+  DioAllocations::Counts before = DioAllocations::ThisThread();
+  int64_t other_thread_allocations = 0;
+  std::thread other([&]() {
+    int64_t start = DioAllocations::ThisThread().allocations;
+    for (int i = 0; i < 1000; ++i) {
+      std::unique_ptr<int> p(new int(i));
+      DioDoNotOptimize(p.get());
+    }
+    other_thread_allocations = DioAllocations::ThisThread().allocations - start;
+  });
+  other.join();
+  DioExpect(other_thread_allocations == 1000);
+  // Starting the thread allocated its state here, but nothing like 1000.
+  DioExpect(DioAllocations::ThisThread().allocations - before.allocations <
+            10);
+};
+
+DIOTEST(Test_ExpectAllocationsAfterReset) = []() {
+  std::vector<int> v(100);
+  DioResetAllocations();
+  int sum = 0;
+  for (int x : v) {
+    sum += x;
+  }
+  DioDoNotOptimize(sum);
+  DioExpectAllocationsAtMost(0);
+  DioExpectAllocatedBytesAtMost(0);
+
+  std::string s(64, 'x');
+  DioDoNotOptimize(s.data());
+  DioExpectAllocationsAtMost(1);
+  DioExpectAllocatedBytesAtMost(65);
+};
+
+DIOTEST(Test_RunAndRecordCountsAllocations) = []() {
+  DioTest allocating = []() {
+    std::vector<std::unique_ptr<int>> v;
+    v.reserve(3);
+    for (int i = 0; i < 3; ++i) {
+      v.emplace_back(new int(i));
+    }
+  };
+  DioTest::AllTests().pop_back();
+  DioTest::Result result;
+  allocating.RunAndRecord(&result);
+  DioExpect(result.num_allocations == 4);
+  DioExpect(result.allocated_bytes ==
+            3 * (sizeof(int) + sizeof(std::unique_ptr<int>)));
+
+  // Also when run in a child process.
+  std::vector<DioTest::Result> results(1);
+  DioTest::RunIsolated({&allocating}, 1, &results);
+  DioExpect(results[0].num_allocations == 4);
+};
+
+DIOBENCH(BM_NewDelete) = [](DioBenchState& s) {
+  while (s.KeepRunning()) {
+    std::unique_ptr<int64_t> p(new int64_t(1));
+    DioDoNotOptimize(p.get());
+  }
+};
+
+DIOTEST(Test_BenchmarkAllocationsPerOp) = []() {
+  const DioBench* bench = nullptr;
+  for (const DioBench* b : DioBench::AllBenchmarks()) {
+    if (std::string(b->bench_name) == "BM_NewDelete") {
+      bench = b;
+    }
+  }
+  DioExpect(bench != nullptr);
+  DioBench::Options options;
+  options.num_samples = 2;
+  options.sample_ms = 1;
+  options.counters = false;
+  DioBench::Result result = DioBench::Measure(bench, options);
+  DioExpect(result.allocations_per_op == 1);
+  DioExpect(result.bytes_per_op == sizeof(int64_t));
+
+  std::vector<DioBench::Result> read;
+  std::string error;
+  DioExpect(DioBench::FromJson(DioBench::ToJson({result}), &read, &error));
+  DioExpect(read.size() == 1);
+  DioExpect(read[0].allocations_per_op == 1);
+  DioExpect(read[0].bytes_per_op == sizeof(int64_t));
+};
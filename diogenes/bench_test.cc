@@ -0,0 +1,202 @@
+// Tests of the benchmark support. Run the benchmark below with:
+//
+//   ./bench_test_main --diobench=all
+
+DIOBENCH(BM_SumLoop) = [](DioBenchState& s) {
+  int64_t sum = 0;
+  while (s.KeepRunning()) {
+    for (int i = 0; i < 100; ++i) {
+      sum += i;
+      DioClobberMemory();
+    }
+  }
+  DioDoNotOptimize(sum);
+};
+
+DIOTEST(Test_KeepRunningRunsEachIteration) = []() {
+  DioBenchState s(1000);
+  int n = 0;
+  while (s.KeepRunning()) {
+    ++n;
+  }
+  DioExpect(n == 1000);
+  DioExpect(s.iterations() == 1000);
+  DioExpect(s.elapsed_ns() > 0);
+  DioExpect(!s.KeepRunning());
+};
+
+DIOTEST(Test_PausedTimeNotCounted) = []() {
+  DioBenchState s(1);
+  while (s.KeepRunning()) {
+    s.PauseTiming();
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    s.ResumeTiming();
+  }
+  DioExpect(s.elapsed_ns() < 10e6);
+};
+
+DIOTEST(Test_ResultStatistics) = []() {
+  DioBench::Result result;
+  result.ns_per_op = {10, 12, 14};
+  DioExpect(result.Mean() == 12);
+  DioExpect(result.StdDev() == 2);
+  // t(0.975, 2) = 4.303.
+  DioExpect(std::fabs(result.ConfidenceInterval95() -
+                      4.303 * 2 / std::sqrt(3.0)) < 1e-9);
+  DioExpect(DioBench::StudentT95(1) == 12.706);
+  DioExpect(DioBench::StudentT95(1000) == 1.96);
+};
+
+DIOTEST(Test_MeasureCalibratesIterations) = []() {
+  DioBench::Options options;
+  options.num_samples = 3;
+  options.sample_ms = 2;
+  DioBench::Result result = DioBench::Measure(&BM_SumLoop, options);
+  DioExpect(result.name == "BM_SumLoop");
+  DioExpect(result.ns_per_op.size() == 3);
+  DioExpect(result.iterations > 1);
+  // Each sample was calibrated to take at least about sample_ms.
+  DioExpect(result.Mean() * result.iterations > 1e6);
+};
+
+// Hardware counters may not exist where the tests run (e.g., in a VM), so
+// this only checks that a missing counter is explained, not that it counts.
+DIOTEST(Test_PerfCountersDegradeGracefully) = []() {
+  DioPerfCounters counters;
+  DioExpect(counters.available() || !counters.error().empty());
+  counters.Reset();
+  counters.Start();
+  counters.Stop();
+  DioExpect(counters.Read().size() <= 5);
+};
+
+// Software counters are provided by the kernel itself, so they can be used
+// to check counting end to end.
+DIOTEST(Test_PerfCountersCount) = []() {
+  DioPerfCounters counters(false /* add_defaults */);
+  DioExpect(!counters.available());
+  if (!counters.Add("task-clock", PERF_TYPE_SOFTWARE,
+                    PERF_COUNT_SW_TASK_CLOCK)) {
+    cout << "Skipping: " << counters.error() << endl;
+    return;
+  }
+  counters.Reset();
+  DioBenchState s(100000, &counters);
+  int64_t sum = 0;
+  while (s.KeepRunning()) {
+    sum += s.iterations();
+    DioClobberMemory();
+  }
+  std::vector<std::pair<std::string, double>> values = counters.Read();
+  DioExpect(values.size() == 1);
+  DioExpect(values[0].first == "task-clock");
+  DioExpect(values[0].second > 0);
+};
+
+// A counter that fails to read is missing from that sample's values. The
+// others must still be reported under their own names.
+DIOTEST(Test_MeanCountersWithFailedRead) = []() {
+  std::vector<std::vector<std::pair<std::string, double>>> samples = {
+      {{"cycles", 400}, {"instructions", 800}, {"branch-misses", 25}},
+      {{"cycles", 600}, {"branch-misses", 75}},
+  };
+  auto means = DioBench::MeanCountersPerOp(samples, 100);
+  DioExpect(means.size() == 3);
+  DioExpect(means[0] == std::make_pair(std::string("cycles"), 5.0));
+  DioExpect(means[1] == std::make_pair(std::string("instructions"), 8.0));
+  DioExpect(means[2] == std::make_pair(std::string("branch-misses"), 0.5));
+  DioExpect(DioBench::MeanCountersPerOp({}, 100).empty());
+};
+
+DIOTEST(Test_MeasureWithoutCounters) = []() {
+  DioBench::Options options;
+  options.num_samples = 2;
+  options.sample_ms = 1;
+  options.counters = false;
+  DioBench::Result result = DioBench::Measure(&BM_SumLoop, options);
+  DioExpect(result.counters_per_op.empty());
+  DioExpect(result.CounterPerOp("cycles") == -1);
+};
+
+static DioBench::Result MakeResult(const string& name,
+                                   const std::vector<double>& ns_per_op) {
+  DioBench::Result result;
+  result.name = name;
+  result.iterations = 1000;
+  result.ns_per_op = ns_per_op;
+  return result;
+}
+
+DIOTEST(Test_JsonRoundTrip) = []() {
+  std::vector<DioBench::Result> results = {
+      MakeResult("BM_A", {1.5, 2.25, 1e-3}), MakeResult("BM_\"B\"", {})};
+  results[0].counters_per_op = {{"cycles", 4.5}, {"instructions", 12}};
+  std::vector<DioBench::Result> read;
+  string error;
+  DioExpect(DioBench::FromJson(DioBench::ToJson(results), &read, &error));
+  DioExpect(read.size() == 2);
+  DioExpect(read[0].name == "BM_A");
+  DioExpect(read[0].iterations == 1000);
+  DioExpect(read[0].ns_per_op == results[0].ns_per_op);
+  DioExpect(read[0].counters_per_op == results[0].counters_per_op);
+  DioExpect(read[1].name == "BM_\"B\"");
+  DioExpect(read[1].ns_per_op.empty());
+};
+
+DIOTEST(Test_JsonUnknownFieldsAndErrors) = []() {
+  std::vector<DioBench::Result> read;
+  string error;
+  DioExpect(DioBench::FromJson(
+      "{\"machine\": {\"cpus\": [1, 2], \"vm\": true}, \"format\": "
+      "\"diobench-1\", \"benchmarks\": [{\"name\": \"BM_A\", \"note\": null, "
+      "\"ns_per_op\": [3]}]}",
+      &read, &error));
+  DioExpect(read.size() == 1);
+  DioExpect(read[0].ns_per_op == std::vector<double>{3});
+
+  DioExpect(!DioBench::FromJson(
+      "{\"format\": \"diobench-1\", \"benchmarks\": [", &read, &error));
+  DioExpect(!error.empty());
+  error.clear();
+  DioExpect(!DioBench::FromJson("{\"format\": \"other\"}", &read, &error));
+  DioExpect(error == "unknown format 'other'");
+  DioExpect(!DioBench::LoadResults("/nonexistent/b.json", &read, &error));
+};
+
+DIOTEST(Test_MannWhitney) = []() {
+  std::vector<double> a = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10};
+  std::vector<double> b = {11, 12, 13, 14, 15, 16, 17, 18, 19, 20};
+  // U = 0: z = (50 - 0.5) / sqrt(175) = 3.742.
+  DioExpect(std::fabs(DioBench::MannWhitneyPValue(a, b) - 0.000183) < 1e-5);
+  DioExpect(DioBench::MannWhitneyPValue(a, b) ==
+            DioBench::MannWhitneyPValue(b, a));
+  DioExpect(DioBench::MannWhitneyPValue(a, a) > 0.9);
+  DioExpect(DioBench::MannWhitneyPValue({5, 5, 5}, {5, 5, 5}) == 1);
+  DioExpect(DioBench::MannWhitneyPValue({}, a) == 1);
+};
+
+DIOTEST(Test_CompareFindsRegressions) = []() {
+  std::vector<double> base = {10, 10.1, 9.9, 10.2, 9.8, 10, 10.1, 9.9};
+  std::vector<double> slower, noisy;
+  for (double x : base) {
+    slower.push_back(x * 1.2);
+    noisy.push_back(x * 1.01);
+  }
+  std::vector<DioBench::Result> baseline = {
+      MakeResult("BM_Slower", base), MakeResult("BM_Same", base),
+      MakeResult("BM_Faster", base), MakeResult("BM_Gone", base)};
+  std::vector<DioBench::Result> current = {
+      MakeResult("BM_Slower", slower), MakeResult("BM_Same", noisy),
+      MakeResult("BM_Faster", {5, 5.1, 4.9, 5, 5, 5.1, 4.9, 5}),
+      MakeResult("BM_New", base)};
+  std::vector<DioBench::Comparison> comparisons =
+      DioBench::Compare(baseline, current, 0.05, 0.01);
+  DioExpect(comparisons.size() == 3);
+  DioExpect(comparisons[0].name == "BM_Slower");
+  DioExpect(comparisons[0].regression);
+  DioExpect(std::fabs(comparisons[0].change - 0.2) < 1e-9);
+  // 1% slower: below the threshold even if significant.
+  DioExpect(!comparisons[1].regression);
+  DioExpect(!comparisons[2].regression);
+  DioExpect(DioBench::PrintComparisons(comparisons) == 1);
+};
@@ -73,12 +73,128 @@
 // }
 // // ----- End of example.cpp ------------
 
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fstream>
 #include <functional>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <regex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <typeinfo>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
+
+// Counts heap allocations made through operator new, per thread. Counting
+// needs the replacement operator new and delete defined by
+// DIO_DEFINE_ALLOCATION_HOOK below. test_main.cc defines them when built with
+// -DDIO_COUNT_ALLOCATIONS. Without them, nothing is counted and hooked() is
+// false.
+class DioAllocations {
+ public:
+  struct Counts {
+    int64_t allocations = 0;
+    int64_t bytes = 0;
+  };
+
+  // Allocations made so far by the calling thread.
+  static Counts& ThisThread() {
+    thread_local Counts counts;
+    return counts;
+  }
+
+  // True if the replacement operator new is linked in.
+  static bool& hooked() {
+    static bool hooked = false;
+    return hooked;
+  }
+
+  // Leaves allocations made during its lifetime out of the counts of the
+  // calling thread. Diogenes uses it so that its own expects aren't counted
+  // as allocations made by the test.
+  class Uncounted {
+   public:
+    Uncounted() : start_(ThisThread()) {}
+    ~Uncounted() { ThisThread() = start_; }
+
+   private:
+    const Counts start_;
+  };
+
+  // Counts and makes an allocation, like the standard operator new.
+  static void* Allocate(size_t size) {
+    for (;;) {
+      void* p = malloc((size > 0) ? size : 1);
+      if (p != nullptr) {
+        Counts& counts = ThisThread();
+        ++counts.allocations;
+        counts.bytes += size;
+        return p;
+      }
+      std::new_handler handler = std::get_new_handler();
+      if (handler == nullptr) {
+        throw std::bad_alloc();
+      }
+      handler();
+    }
+  }
+
+  static void* AllocateNoThrow(size_t size) noexcept {
+    try {
+      return Allocate(size);
+    } catch (...) {
+      return nullptr;
+    }
+  }
+};
+
+// Replaces the global operator new and delete with ones that count
+// allocations in DioAllocations. Use it at file scope in exactly one source
+// file of a binary. Aligned new (C++17) isn't replaced, so over-aligned
+// allocations aren't counted.
+#define DIO_DEFINE_ALLOCATION_HOOK \
+void* operator new(size_t size) { return DioAllocations::Allocate(size); } \
+void* operator new[](size_t size) { return DioAllocations::Allocate(size); } \
+void* operator new(size_t size, const std::nothrow_t&) noexcept { \
+  return DioAllocations::AllocateNoThrow(size); \
+} \
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { \
+  return DioAllocations::AllocateNoThrow(size); \
+} \
+void operator delete(void* p) noexcept { free(p); } \
+void operator delete[](void* p) noexcept { free(p); } \
+void operator delete(void* p, size_t) noexcept { free(p); } \
+void operator delete[](void* p, size_t) noexcept { free(p); } \
+void operator delete(void* p, const std::nothrow_t&) noexcept { free(p); } \
+void operator delete[](void* p, const std::nothrow_t&) noexcept { free(p); } \
+static bool dio_allocation_hook = (DioAllocations::hooked() = true)
 
 // A class representing a single test. A static member variable
 // in this class is used to keep track of all tests created.
@@ -97,11 +213,16 @@ class DioTest {
   int linenum = -1;
   const char* test_name = nullptr;
 
+  // Name of the lambda's type. Identifies unnamed tests across runs and
+  // builds, since the compiler derives it from where the lambda is defined
+  // rather than from the order tests get registered in.
+  const char* type_name = nullptr;
+
   // Makes a test out of any void lambda, and adds it to all tests.
   // This is the core idea of Diogenes.
   template <class Lambda>
   DioTest(Lambda l)
-      : t(l) {
+      : t(l), type_name(typeid(Lambda).name()) {
     AllTests().push_back(this);
   }
 
@@ -109,7 +230,8 @@ class DioTest {
   // The macro DIOTEST will probably be more convenient.
   template <class Lambda>
   DioTest(const char *_filename, int _linenum, const char *_test_name, Lambda l)
-      : t(l), filename(_filename), linenum(_linenum), test_name(_test_name) {
+      : t(l), filename(_filename), linenum(_linenum), test_name(_test_name),
+        type_name(typeid(Lambda).name()) {
     AllTests().push_back(this);
   }
 
@@ -138,43 +260,683 @@ class DioTest {
     return tests;
   }
 
-  // run_spec is like: "test_name1,test_name2,filename.cc,..."
+  // Selects tests (or benchmarks) by name or filename. Parsed once from a
+  // run_spec like "Test_Foo,bar.cc,Test_Baz*,re:Test_[0-9]+,-Test_Slow*":
+  // comma-separated patterns, each one of
+  //
+  //   - an exact test name, or filename with or without its directory,
+  //   - a glob, if it has a '*' (any characters) or '?' (any one character),
+  //   - "re:" followed by an ECMAScript regular expression, which must match
+  //     the whole name or filename.
+  //
+  // A pattern starting with '-' excludes what it matches. A test is selected
+  // if it matches any of the other patterns, or if there are none, and
+  // matches no excluding pattern. Exact names are kept in a hash set, so
+  // picking a few tests out of many takes time proportional to the number
+  // of tests and patterns that aren't exact names.
+  class Filter {
+   public:
+    explicit Filter(const std::string& run_spec) {
+      size_t start = 0;
+      while (start <= run_spec.size()) {
+        size_t end = run_spec.find(',', start);
+        if (end == std::string::npos) {
+          end = run_spec.size();
+        }
+        std::string pattern = Trim(run_spec.substr(start, end - start));
+        start = end + 1;
+        if (pattern.empty()) {
+          continue;
+        }
+        bool exclude = (pattern[0] == '-');
+        Patterns& patterns = exclude ? excluded_ : included_;
+        if (exclude) {
+          pattern.erase(0, 1);
+        }
+        if (pattern.compare(0, 3, "re:") == 0) {
+          try {
+            patterns.regexes.emplace_back(pattern.substr(3));
+          } catch (const std::regex_error& e) {
+            error_ = "Bad regular expression in filter: '" +
+                     pattern.substr(3) + "' (" + e.what() + ")";
+          }
+        } else if (pattern.find_first_of("*?") != std::string::npos) {
+          patterns.globs.push_back(pattern);
+        } else {
+          const std::string& owned = *patterns.names.insert(pattern).first;
+          patterns.exact.insert(Name{owned.data(), owned.size()});
+        }
+      }
+    }
+
+    // Set if run_spec had a bad regular expression.
+    const std::string& error() const { return error_; }
+
+    // True if the filter selects everything, e.g. if run_spec was empty.
+    bool SelectsAll() const {
+      return included_.empty() && excluded_.empty();
+    }
+
+    // Either name or filename may be null.
+    bool Selects(const char* name, const char* filename) const {
+      if (!included_.empty() && !included_.Match(name, filename)) {
+        return false;
+      }
+      return excluded_.empty() || !excluded_.Match(name, filename);
+    }
+
+    // Matches pattern, which may contain the wildcards '*' and '?', against
+    // all of s.
+    static bool GlobMatch(const char* pattern, const char* s) {
+      // On a mismatch, let the last '*' seen match one more character and
+      // try again from there.
+      const char* star = nullptr;
+      const char* star_s = nullptr;
+      while (*s != '\0') {
+        if ((*pattern == '?') || (*pattern == *s)) {
+          ++pattern;
+          ++s;
+        } else if (*pattern == '*') {
+          star = pattern++;
+          star_s = s;
+        } else if (star != nullptr) {
+          pattern = star + 1;
+          s = ++star_s;
+        } else {
+          return false;
+        }
+      }
+      while (*pattern == '*') {
+        ++pattern;
+      }
+      return *pattern == '\0';
+    }
+
+   private:
+    // A name not owned by the Name, so that looking up names in the set of
+    // exact names doesn't copy them into strings.
+    struct Name {
+      const char* data;
+      size_t size;
+
+      bool operator==(const Name& other) const {
+        return (size == other.size) && (memcmp(data, other.data, size) == 0);
+      }
+    };
+
+    struct NameHash {
+      size_t operator()(const Name& name) const {
+        return StableHash(name.data, name.size);
+      }
+    };
+
+    struct Patterns {
+      // Exact names, pointing into names.
+      std::unordered_set<Name, NameHash> exact;
+      std::unordered_set<std::string> names;
+      std::vector<std::string> globs;
+      std::vector<std::regex> regexes;
+
+      bool empty() const {
+        return exact.empty() && globs.empty() && regexes.empty();
+      }
+
+      bool Match(const char* name, const char* filename) const {
+        if (name != nullptr && MatchOne(name)) {
+          return true;
+        }
+        if (filename == nullptr) {
+          return false;
+        }
+        if (MatchOne(filename)) {
+          return true;
+        }
+        const char* base = strrchr(filename, '/');
+        return (base != nullptr) && MatchOne(base + 1);
+      }
+
+      bool MatchOne(const char* s) const {
+        if (!exact.empty() && (exact.count(Name{s, strlen(s)}) > 0)) {
+          return true;
+        }
+        for (const std::string& glob : globs) {
+          if (GlobMatch(glob.c_str(), s)) {
+            return true;
+          }
+        }
+        for (const std::regex& regex : regexes) {
+          if (std::regex_match(s, regex)) {
+            return true;
+          }
+        }
+        return false;
+      }
+    };
+
+    static std::string Trim(const std::string& s) {
+      size_t begin = s.find_first_not_of(" \t");
+      if (begin == std::string::npos) {
+        return "";
+      }
+      return s.substr(begin, s.find_last_not_of(" \t") - begin + 1);
+    }
+
+    Patterns included_;
+    Patterns excluded_;
+    std::string error_;
+  };
+
+  // Parses run_spec every time. To select from many tests, make one Filter
+  // and use it for each of them, as RunAll does.
   static bool ShouldRunTest(DioTest* t, const std::string& run_spec) {
-    if ((t->filename == nullptr) || (t->test_name == nullptr)) {
-      return false;
+    return Filter(run_spec).Selects(t->test_name, t->filename);
+  }
+
+  // Key used to assign this test to a shard: its name, or the name of its
+  // lambda's type if it has no name.
+  std::string ShardKey() const {
+    if (test_name != nullptr) {
+      return test_name;
+    }
+    return (type_name != nullptr) ? type_name : "";
+  }
+
+  // 64-bit FNV-1a hash of s. Unlike std::hash, the same on every platform and
+  // standard library, so shards don't change between builds.
+  static uint64_t StableHash(const std::string& s) {
+    return StableHash(s.data(), s.size());
+  }
+
+  static uint64_t StableHash(const char* s, size_t size) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < size; ++i) {
+      hash ^= static_cast<unsigned char>(s[i]);
+      hash *= 1099511628211ULL;
+    }
+    return hash;
+  }
+
+  // Returns the shard, in [0, num_shards), that t belongs to.
+  static int ShardOf(const DioTest* t, int num_shards) {
+    return static_cast<int>(StableHash(t->ShardKey()) %
+                            static_cast<uint64_t>(num_shards));
+  }
+
+  // Returns the value of the environment variable name, or default_value if
+  // it is not set.
+  static std::string StringFromEnv(const char* name,
+                                   const std::string& default_value) {
+    const char* value = getenv(name);
+    return (value != nullptr) ? value : default_value;
+  }
+
+  // Returns the value of the environment variable name as an int, or
+  // default_value if it is not set or not a number.
+  static int IntFromEnv(const char* name, int default_value) {
+    const char* value = getenv(name);
+    if ((value == nullptr) || (*value == '\0')) {
+      return default_value;
+    }
+    char* end = nullptr;
+    long parsed = strtol(value, &end, 10);
+    return (*end == '\0') ? static_cast<int>(parsed) : default_value;
+  }
+
+  // Outcome of running one test.
+  struct Result {
+    int num_passed_expects = 0;
+    int num_failed_expects = 0;
+
+    // Set when the test ran in a child process that died before reporting
+    // its result, e.g., "killed by signal 6 (Aborted)".
+    std::string crash;
+
+    // Time the test took, including setup and teardown. CPU time is that of
+    // the thread running the test only.
+    double wall_ms = 0;
+    double cpu_ms = 0;
+
+    // Heap allocations made by the thread running the test, if counted. See
+    // DioAllocations.
+    int64_t num_allocations = 0;
+    int64_t allocated_bytes = 0;
+  };
+
+  // How RunAll runs tests.
+  struct RunOptions {
+    // Which tests to run. See Filter. Empty means all tests.
+    std::string run_spec;
+
+    // Number of tests to run at the same time. 0 means one per core.
+    int num_jobs = 1;
+
+    // Run each test in a child process forked from this one. A test that
+    // crashes then doesn't end the run, and changes a test makes to global
+    // state (flags, loggers, snapshots) are not seen by other tests.
+    bool isolate = false;
+
+    // Fail a test that takes longer than this. 0 means no limit. Isolated
+    // tests are killed and the run goes on. Other tests can't be stopped, so
+    // the run ends with the summary so far.
+    int timeout_ms = 0;
+
+    // After the summary, list this many of the slowest tests.
+    int num_slowest = 5;
+
+    // Run only the tests in shard shard_index of num_shards. Tests are
+    // assigned to shards by a hash of their ShardKey, so a test stays in
+    // its shard regardless of link order or of which other tests exist.
+    int shard_index = 0;
+    int num_shards = 1;
+  };
+
+  // Result of the test currently running in this thread, if any. DioExpect
+  // records into it. This keeps the expects of tests running in parallel
+  // apart.
+  static Result*& CurrentResult() {
+    thread_local Result* current_result = nullptr;
+    return current_result;
+  }
+
+  // Name of the test for reports.
+  std::string DisplayName() const {
+    return (test_name != nullptr) ? test_name : "(unnamed test)";
+  }
+
+  // Allocation counts of the calling thread when its current test started, or
+  // when DioResetAllocations was last called. DioExpectAllocationsAtMost
+  // checks the allocations made since then.
+  static DioAllocations::Counts& AllocationsMark() {
+    thread_local DioAllocations::Counts mark;
+    return mark;
+  }
+
+  // CPU time used so far by the calling thread.
+  static double ThreadCpuMs() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+  }
+
+  // Runs this test, with its setup and teardown, recording its expects and
+  // the time it took into result. May be called from within another test,
+  // whose expects are then recorded into its own result again afterwards.
+  void RunAndRecord(Result* result) {
+    auto wall_start = std::chrono::steady_clock::now();
+    double cpu_start = ThreadCpuMs();
+    const DioAllocations::Counts allocations_start =
+        DioAllocations::ThisThread();
+    Result* outer_result = CurrentResult();
+    const DioAllocations::Counts outer_mark = AllocationsMark();
+    CurrentResult() = result;
+    AllocationsMark() = allocations_start;
+    Setup();
+    Run();
+    Teardown();
+    CurrentResult() = outer_result;
+    AllocationsMark() = outer_mark;
+    result->num_allocations = DioAllocations::ThisThread().allocations -
+                              allocations_start.allocations;
+    result->allocated_bytes =
+        DioAllocations::ThisThread().bytes - allocations_start.bytes;
+    result->cpu_ms = ThreadCpuMs() - cpu_start;
+    result->wall_ms = std::chrono::duration<double, std::milli>(
+                          std::chrono::steady_clock::now() - wall_start)
+                          .count();
+  }
+
+  // Adds the result of a test to the totals and prints it.
+  static void ReportResult(const DioTest* t, const Result& result) {
+    RecordExpectStatusOrPrintResults(false /* ignored */,
+                                     2 /* increment number of test run */);
+    if (!result.crash.empty() || (result.num_failed_expects > 0)) {
+      RecordExpectStatusOrPrintResults(false /* ignored */,
+                                       4 /* record name of failing test*/,
+                                       t->DisplayName().c_str());
+    }
+    std::ostringstream time;
+    time << std::fixed << std::setprecision(1) << result.wall_ms << " ms";
+    if (DioAllocations::hooked()) {
+      time << ", " << result.num_allocations << " allocations";
+    }
+    if (!result.crash.empty()) {
+      std::cout << "Test CRASHED: " << t->DisplayName() << " ("
+                << result.crash << ")" << std::endl;
+    } else if (result.num_failed_expects > 0) {
+      std::cout << "Test FAILED: " << t->DisplayName() << " ("
+                << result.num_failed_expects << " failed expects, "
+                << time.str() << ")" << std::endl;
+    } else {
+      std::cout << "Test passed: " << t->DisplayName() << " (" << time.str()
+                << ")" << std::endl;
+    }
+  }
+
+  // Prints the num_slowest tests by wall time, slowest first.
+  static void PrintSlowest(const std::vector<DioTest*>& tests,
+                           const std::vector<Result>& results,
+                           int num_slowest) {
+    std::vector<size_t> order;
+    for (size_t i = 0; i < tests.size(); ++i) {
+      order.push_back(i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return results[a].wall_ms > results[b].wall_ms;
+    });
+    if (order.size() > static_cast<size_t>(std::max(0, num_slowest))) {
+      order.resize(std::max(0, num_slowest));
+    }
+    if (order.empty()) {
+      return;
+    }
+    std::cout << "Slowest tests:" << std::endl;
+    for (size_t i : order) {
+      std::ostringstream line;
+      line << std::fixed << std::setprecision(1) << "  " << std::setw(9)
+           << results[i].wall_ms << " ms wall " << std::setw(9)
+           << results[i].cpu_ms << " ms cpu  " << tests[i]->DisplayName();
+      std::cout << line.str() << std::endl;
+    }
+  }
+
+  // Ends the run if a test running in this process takes longer than
+  // timeout_ms. Such a test can't be stopped, so the best that can be done
+  // is to say which test hung, print the summary so far, and exit with
+  // status 1 instead of waiting forever.
+  class Watchdog {
+   public:
+    Watchdog(const std::vector<DioTest*>& tests, int timeout_ms)
+        : tests_(tests), timeout_ms_(timeout_ms),
+          started_ns_(new std::atomic<int64_t>[tests.size()]()) {
+      if (timeout_ms_ > 0) {
+        thread_ = std::thread([this]() { Watch(); });
+      }
+    }
+
+    ~Watchdog() {
+      if (thread_.joinable()) {
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          done_ = true;
+        }
+        done_cv_.notify_one();
+        thread_.join();
+      }
+    }
+
+    // Called around running test i.
+    void Started(size_t i) { started_ns_[i] = NowNs(); }
+    void Finished(size_t i) { started_ns_[i] = 0; }
+
+   private:
+    static int64_t NowNs() {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now().time_since_epoch())
+          .count();
+    }
+
+    void Watch() {
+      const int64_t timeout_ns = timeout_ms_ * int64_t{1000000};
+      auto period = std::chrono::milliseconds(std::max(1, timeout_ms_ / 10));
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (!done_cv_.wait_for(lock, period, [this]() { return done_; })) {
+        int64_t now = NowNs();
+        for (size_t i = 0; i < tests_.size(); ++i) {
+          int64_t started = started_ns_[i];
+          if ((started != 0) && (now - started > timeout_ns)) {
+            std::cout << "Test TIMED OUT: " << tests_[i]->DisplayName()
+                      << " (still running after " << timeout_ms_
+                      << " ms; use --dio_isolate=true to kill hung tests and"
+                      << " go on)" << std::endl;
+            RecordExpectStatusOrPrintResults(false /* ignored */,
+                                             2 /* increment tests run */);
+            RecordExpectStatusOrPrintResults(false /* ignored */,
+                                             4 /* record failing test */,
+                                             tests_[i]->DisplayName().c_str());
+            RecordExpectStatusOrPrintResults(false /* ignored */,
+                                             0 /* print status */);
+            std::cout.flush();
+            _exit(1);
+          }
+        }
+      }
+    }
+
+    const std::vector<DioTest*>& tests_;
+    const int timeout_ms_;
+    // When each test started, in steady clock nanoseconds, or 0 if it isn't
+    // running.
+    std::unique_ptr<std::atomic<int64_t>[]> started_ns_;
+    std::mutex mutex_;
+    std::condition_variable done_cv_;
+    bool done_ = false;
+    std::thread thread_;
+  };
+
+  // Runs each of tests in a child process forked from this one, with at most
+  // num_jobs children at a time, and stores their results in results. If
+  // timeout_ms > 0, children that run longer than that are killed.
+  //
+  // Forking happens after static initialization, so every test starts from
+  // the state the binary had after startup without paying for it again.
+  // Expects made by the children are added to the totals of this process.
+  static void RunIsolated(const std::vector<DioTest*>& tests, int num_jobs,
+                          std::vector<Result>* results, int timeout_ms = 0) {
+    struct Child {
+      size_t test_index;
+      int result_fd;
+      std::chrono::steady_clock::time_point started;
+      bool timed_out;
+    };
+    // What a child sends back over its pipe.
+    struct Report {
+      int num_passed_expects;
+      int num_failed_expects;
+      double wall_ms;
+      double cpu_ms;
+      int64_t num_allocations;
+      int64_t allocated_bytes;
+    };
+    std::unordered_map<pid_t, Child> running;
+    size_t next_test = 0;
+    while ((next_test < tests.size()) || !running.empty()) {
+      if ((next_test < tests.size()) &&
+          (running.size() < static_cast<size_t>(num_jobs))) {
+        size_t i = next_test++;
+        int fds[2];
+        if (pipe(fds) != 0) {
+          (*results)[i].crash = std::string("pipe failed: ") + strerror(errno);
+          continue;
+        }
+        // Don't let the child inherit, and later print again, buffered output.
+        std::cout.flush();
+        std::cerr.flush();
+        pid_t pid = fork();
+        if (pid == 0) {
+          close(fds[0]);
+          Result result;
+          tests[i]->RunAndRecord(&result);
+          Report report = {result.num_passed_expects,
+                           result.num_failed_expects, result.wall_ms,
+                           result.cpu_ms, result.num_allocations,
+                           result.allocated_bytes};
+          std::cout.flush();
+          std::cerr.flush();
+          // Skip static destructors and atexit handlers; they belong to the
+          // parent.
+          _exit(write(fds[1], &report, sizeof(report)) == sizeof(report) ? 0
+                                                                         : 1);
+        }
+        close(fds[1]);
+        if (pid < 0) {
+          close(fds[0]);
+          (*results)[i].crash = std::string("fork failed: ") + strerror(errno);
+          continue;
+        }
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        running[pid] = Child{i, fds[0], std::chrono::steady_clock::now(),
+                             false};
+        continue;
+      }
+
+      // Wait for a child to write its result or to die. Waiting on the pipes,
+      // and then on those children only, leaves children forked by anyone
+      // else alone, including by a test running RunIsolated itself.
+      std::vector<pollfd> pollfds;
+      std::vector<pid_t> pids;
+      for (const auto& child : running) {
+        pollfds.push_back(pollfd{child.second.result_fd, POLLIN, 0});
+        pids.push_back(child.first);
+      }
+      // A grandchild may still hold a pipe open after its child died, so
+      // wake up regularly to look for dead children, and also in time to
+      // kill the child that has run the longest.
+      const int kMaxPollMs = 100;
+      int poll_timeout_ms = kMaxPollMs;
+      if (timeout_ms > 0) {
+        auto now = std::chrono::steady_clock::now();
+        for (auto& child : running) {
+          int64_t remaining_ms =
+              timeout_ms -
+              std::chrono::duration_cast<std::chrono::milliseconds>(
+                  now - child.second.started)
+                  .count();
+          if ((remaining_ms <= 0) && !child.second.timed_out) {
+            kill(child.first, SIGKILL);
+            child.second.timed_out = true;
+          }
+          if (!child.second.timed_out) {
+            poll_timeout_ms = std::min<int64_t>(poll_timeout_ms, remaining_ms);
+          }
+        }
+      }
+      int num_ready = poll(pollfds.data(), pollfds.size(), poll_timeout_ms);
+      if ((num_ready < 0) && (errno != EINTR)) {
+        break;
+      }
+      for (size_t k = 0; k < pids.size(); ++k) {
+        pid_t pid = pids[k];
+        const Child& child = running[pid];
+        // The report or end of file, if the child died without writing it.
+        // The child exits right after writing, so then wait for it. Otherwise
+        // the child is done only if it has exited; the read end doesn't block,
+        // so a report it wrote just before is still picked up.
+        Report report;
+        ssize_t num_read = -1;
+        if ((num_ready > 0) && (pollfds[k].revents != 0)) {
+          num_read = read(child.result_fd, &report, sizeof(report));
+        }
+        int status = 0;
+        if (num_read >= 0) {
+          while ((waitpid(pid, &status, 0) < 0) && (errno == EINTR)) {
+          }
+        } else {
+          if (waitpid(pid, &status, WNOHANG) == 0) {
+            continue;
+          }
+          num_read = read(child.result_fd, &report, sizeof(report));
+        }
+        bool reported = (num_read == sizeof(report));
+        Result& result = (*results)[child.test_index];
+        close(child.result_fd);
+        bool timed_out = child.timed_out;
+        double wall_ms = std::chrono::duration<double, std::milli>(
+                             std::chrono::steady_clock::now() - child.started)
+                             .count();
+        running.erase(pid);
+        result.wall_ms = wall_ms;
+        if (timed_out) {
+          result.crash =
+              "timed out after " + std::to_string(timeout_ms) + " ms";
+        } else if (WIFSIGNALED(status)) {
+          result.crash = "killed by signal " +
+                         std::to_string(WTERMSIG(status)) + " (" +
+                         strsignal(WTERMSIG(status)) + ")";
+        } else if (!reported || (WEXITSTATUS(status) != 0)) {
+          result.crash = "exited with status " +
+                         std::to_string(WEXITSTATUS(status)) +
+                         " before reporting";
+        }
+        if (reported) {
+          result.num_passed_expects = report.num_passed_expects;
+          result.num_failed_expects = report.num_failed_expects;
+          result.wall_ms = report.wall_ms;
+          result.cpu_ms = report.cpu_ms;
+          result.num_allocations = report.num_allocations;
+          result.allocated_bytes = report.allocated_bytes;
+          for (int n = 0; n < report.num_passed_expects; ++n) {
+            RecordExpectStatusOrPrintResults(true, 1 /* record */);
+          }
+          for (int n = 0; n < report.num_failed_expects; ++n) {
+            RecordExpectStatusOrPrintResults(false, 1 /* record */);
+          }
+        }
+      }
     }
-    return (run_spec.find(t->filename) != std::string::npos) ||
-           (run_spec.find(t->test_name) != std::string::npos);
   }
 
   // Runs all tests. If run_spec is not null, runs the subset specified by that
   // spec.
-  static void RunAll(const std::string& run_spec = "") {
+  static void RunAll(const std::string& run_spec = "", int num_jobs = 1) {
+    RunOptions options;
+    options.run_spec = run_spec;
+    options.num_jobs = num_jobs;
+    RunAll(options);
+  }
+
+  // Runs the tests selected by options.run_spec that are in the shard
+  // options.shard_index.
+  //
+  // With num_jobs > 1, tests run in parallel. Unless they are isolated, they
+  // run on threads of this process and then must not depend on each other or
+  // share global state. Output printed by the tests themselves will
+  // interleave, but results are reported in the same order as a serial run,
+  // after all tests have finished.
+  static void RunAll(const RunOptions& options) {
+    const Filter filter(options.run_spec);
+    if (!filter.error().empty()) {
+      std::cerr << filter.error() << std::endl;
+    }
+    assert(filter.error().empty());
+    std::vector<DioTest*> selected;
     for (DioTest* f : AllTests()) {
-      if (run_spec.empty() || ShouldRunTest(f, run_spec)) {
+      if ((options.num_shards > 1) &&
+          (ShardOf(f, options.num_shards) != options.shard_index)) {
+        continue;
+      }
+      if (filter.SelectsAll() || filter.Selects(f->test_name, f->filename)) {
+        selected.push_back(f);
+      }
+    }
+    std::vector<Result> results(selected.size());
+
+    int num_jobs = options.num_jobs;
+    if (num_jobs == 0) {
+      num_jobs = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // Only used for tests that run in this process.
+    Watchdog watchdog(selected, options.isolate ? 0 : options.timeout_ms);
+
+    if (options.isolate) {
+      RunIsolated(selected, std::max(1, num_jobs), &results,
+                  options.timeout_ms);
+      for (size_t i = 0; i < selected.size(); ++i) {
+        ReportResult(selected[i], results[i]);
+      }
+    } else if (num_jobs <= 1) {
+      for (size_t i = 0; i < selected.size(); ++i) {
+        DioTest* f = selected[i];
 #if !defined(DONT_INCLUDE_LOGGING)
         if (f->filename) {
           LOG(INFO) << "Running test: " << f->test_name << " at " << f->filename
                     << ":" << f->linenum;
         }
 #endif
-        f->Setup();
-        RecordExpectStatusOrPrintResults(false /* ignored */,
-                                         2 /* increment number of test run */);
-        int num_failed_expects_before =
-            RecordExpectStatusOrPrintResults(false /* ignored */, 3);
-        f->Run();
-        int num_failed_expects_after =
-            RecordExpectStatusOrPrintResults(false /* ignored */, 3);
-        std::cout << "num_failed_expects_before: " << num_failed_expects_before
-                  << " num_failed_expects_after: " << num_failed_expects_after
-                  << std::endl;
-        f->Teardown();
-        if (num_failed_expects_after > num_failed_expects_before) {
-          RecordExpectStatusOrPrintResults(false /* ignored */,
-                                           4 /* record name of failing test*/,
-                                           f->test_name);
-        }
+        watchdog.Started(i);
+        f->RunAndRecord(&results[i]);
+        watchdog.Finished(i);
+        ReportResult(f, results[i]);
 #if !defined(DONT_INCLUDE_LOGGING)
         if (f->filename) {
           LOG(INFO) << "Finished test: " << f->test_name << " at " << f->filename
@@ -182,19 +944,46 @@ class DioTest {
         }
 #endif
       }
+    } else {
+      // Each worker repeatedly takes the next test that hasn't been started.
+      std::atomic<size_t> next_test{0};
+      auto worker = [&]() {
+        for (size_t i = next_test++; i < selected.size(); i = next_test++) {
+          watchdog.Started(i);
+          selected[i]->RunAndRecord(&results[i]);
+          watchdog.Finished(i);
+        }
+      };
+      std::vector<std::thread> workers;
+      for (int j = 0; j < num_jobs; ++j) {
+        workers.emplace_back(worker);
+      }
+      for (auto& w : workers) {
+        w.join();
+      }
+      for (size_t i = 0; i < selected.size(); ++i) {
+        ReportResult(selected[i], results[i]);
+      }
     }
-    RecordExpectStatusOrPrintResults(false /* ignored */,
-                                     0 /* print status */);
+
+    PrintSlowest(selected, results, options.num_slowest);
+    int num_failed_tests = RecordExpectStatusOrPrintResults(
+        false /* ignored */, 0 /* print status */);
+    assert(num_failed_tests == 0);
   }
 
   // If 'record' is true, keeps track of the number of failing and
   // passing tests. If 'record' is false, print a report to
-  // stdout saying how many passed and failed.
+  // stdout saying how many passed and failed, and return the number of
+  // failed tests.
+  //
+  // Safe to call from multiple threads.
   static int RecordExpectStatusOrPrintResults(bool value, int op,
                                                const char* test_name = nullptr) {
-    static int num_tests_run = 0;
-    static int passed = 0;
-    static int failed = 0;
+    static std::atomic<int> num_tests_run{0};
+    static std::atomic<int> passed{0};
+    static std::atomic<int> failed{0};
+    static std::mutex failed_test_names_mutex;
     static std::vector<std::string> failed_test_names;
 
     if (op == 1) {
@@ -209,11 +998,11 @@ class DioTest {
       return failed;
     } else if (op == 4) {
       if (test_name != nullptr) {
-        failed_test_names.push_back(string(test_name));
-        std::cout << "new failed_test_names.size: " << failed_test_names.size()
-                  << std::endl;
+        std::lock_guard<std::mutex> lock(failed_test_names_mutex);
+        failed_test_names.push_back(std::string(test_name));
       }
     } else if (op == 0) {
+      std::lock_guard<std::mutex> lock(failed_test_names_mutex);
       std::cout << "Diogenes results: Ran " << num_tests_run
                 << " tests. Num failed tests: " << failed_test_names.size()
                 << " and " << passed << "/" << (passed + failed)
@@ -228,18 +1017,54 @@ class DioTest {
         }
         std::cout << std::endl;
       }
-      assert(failed == 0);
+      return failed_test_names.size();
     }
     return -1;
   }
 
   // Prefer the macro DioExpect below.
   static void DioExpect2(const std::string& expression_str, bool value) {
+    DioExpect2(expression_str.c_str(), value);
+  }
+
+  static void DioExpect2(const char* expression_str, bool value) {
+    DioAllocations::Uncounted uncounted;
     RecordExpectStatusOrPrintResults(value, 1 /* record */);
+    Result* result = CurrentResult();
+    if (result != nullptr) {
+      if (value) {
+        ++result->num_passed_expects;
+      } else {
+        ++result->num_failed_expects;
+      }
+    }
     if (!value) {
       std::cerr << "Failed test: '" << expression_str << "'" << std::endl;
     }
   }
+
+  // Prefer the macros DioExpectAllocationsAtMost and
+  // DioExpectAllocatedBytesAtMost below.
+  static void DioExpectAllocations2(const char* expectation, int64_t limit,
+                                    bool bytes) {
+    if (!DioAllocations::hooked()) {
+      static std::once_flag warned;
+      std::call_once(warned, []() {
+        std::cerr << "Allocations aren't counted, so allocation expects are "
+                  << "skipped. Build with -DDIO_COUNT_ALLOCATIONS to count "
+                  << "them." << std::endl;
+      });
+      return;
+    }
+    const DioAllocations::Counts& now = DioAllocations::ThisThread();
+    int64_t allocations = now.allocations - AllocationsMark().allocations;
+    int64_t allocated_bytes = now.bytes - AllocationsMark().bytes;
+    DioAllocations::Uncounted uncounted;
+    std::ostringstream os;
+    os << expectation << "(" << limit << "), but made " << allocations
+       << " allocations of " << allocated_bytes << " bytes";
+    DioExpect2(os.str(), (bytes ? allocated_bytes : allocations) <= limit);
+  }
 };
 
 // I'm not happy about this macro, since it's not very ELI5. But running
@@ -293,18 +1118,149 @@ typedef DioTest Diogenes;
 // test passes.
 #define DioExpect(EXP) DioTest::DioExpect2((#EXP), (EXP))
 
+// Expects the current test to have made at most N heap allocations, or
+// allocated at most N bytes, on its thread so far. Call DioResetAllocations
+// first to leave out allocations made while setting up. Needs
+// -DDIO_COUNT_ALLOCATIONS; see DioAllocations.
+//
+//   DIOTEST(Test_LookupDoesNotAllocate) = []() {
+//     Table table = MakeTable();
+//     DioResetAllocations();
+//     table.Lookup("key");
+//     DioExpectAllocationsAtMost(0);
+//   };
+#define DioExpectAllocationsAtMost(N) \
+    DioTest::DioExpectAllocations2("DioExpectAllocationsAtMost", (N), false)
+#define DioExpectAllocatedBytesAtMost(N) \
+    DioTest::DioExpectAllocations2("DioExpectAllocatedBytesAtMost", (N), true)
+
+inline void DioResetAllocations() {
+  DioTest::AllocationsMark() = DioAllocations::ThisThread();
+}
+
 // ================= Observability: snapshotting variables =============
-// The basic idea is to have one cache per C++ type in which snapshotted
-// values are stored. Snapshotted values are keyed by a string key for
-// later retrieval. Cache singleton-ness is achieved by making it a static
-// variable within this function.`
+// The basic idea is to have one store per C++ type in which snapshotted
+// values are kept. Snapshotted values are keyed by a string key for later
+// retrieval. Each key gets a slot holding one value. The first value
+// snapshotted with a key is kept; later ones are ignored.
+//
+// Snapshots may be left in performance-critical code:
+//
+// - Each DioSnapshot and DioSnapshotOnExit looks up its slot the first time
+//   it runs and keeps it with its key. When the same line runs again with
+//   the same key (e.g., a string literal), a snapshot whose slot is already
+//   filled costs a key comparison and one atomic load, with no hashing,
+//   allocation or copy. Keys that change from call to call work too, but
+//   are looked up each time.
 //
-// This function gets or sets from the cache, depending upon the
-// arguments. This is a simple way to ensure that get and set operations
-// both use the same cache.
+// - Slots are filled and read safely from any thread, without locks.
+//
+// - Building with -DDIO_DISABLE_SNAPSHOTS compiles snapshots to nothing.
+//   Nothing is then recorded, so tests that read snapshots only make sense in
+//   builds that keep them.
 //
 // Snapshots are created by copying, so the things being snapshotted
 // should be copyable.
+
+// Holds the snapshotted value for one key of type T.
+template <class T>
+class DioSnapshotSlot {
+ public:
+  // Returns the slot for key, making it if create is true and there is no
+  // slot yet. Otherwise returns nullptr if there is none. Slots live until
+  // the program ends, so callers may keep the pointer.
+  static DioSnapshotSlot* ForKey(const std::string& key, bool create) {
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<DioSnapshotSlot>>
+        slots;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto loc = slots.find(key);
+    if (loc != slots.end()) {
+      return loc->second.get();
+    }
+    if (!create) {
+      return nullptr;
+    }
+    DioSnapshotSlot* slot = new DioSnapshotSlot();
+    slots[key].reset(slot);
+    return slot;
+  }
+
+  ~DioSnapshotSlot() {
+    if (state_.load(std::memory_order_acquire) == kFull) {
+      reinterpret_cast<T*>(&storage_)->~T();
+    }
+  }
+
+  // Keeps a copy of value, unless the slot already has one.
+  void Set(const T& value) {
+    if (state_.load(std::memory_order_acquire) != kEmpty) {
+      return;
+    }
+    int expected = kEmpty;
+    if (state_.compare_exchange_strong(expected, kWriting,
+                                       std::memory_order_acq_rel)) {
+      new (&storage_) T(value);
+      state_.store(kFull, std::memory_order_release);
+    }
+  }
+
+  // Returns the value, or nullptr if there is none yet.
+  const T* Get() const {
+    if (state_.load(std::memory_order_acquire) != kFull) {
+      return nullptr;
+    }
+    return reinterpret_cast<const T*>(&storage_);
+  }
+
+ private:
+  DioSnapshotSlot() = default;
+
+  enum { kEmpty, kWriting, kFull };
+  std::atomic<int> state_{kEmpty};
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type storage_;
+};
+
+// Returns the slot for key of the type of var. Lets the macros below deduce
+// the type.
+template <class T>
+DioSnapshotSlot<T>* DioSnapshotSlotFor(const T& var, const std::string& key) {
+  return DioSnapshotSlot<T>::ForKey(key, true /* create */);
+}
+
+// The slot for the first key a DioSnapshot or DioSnapshotOnExit call site
+// sees, kept with that key. Later calls with the same key reuse the slot;
+// calls with another key look theirs up.
+template <class T>
+class DioSnapshotSlotCache {
+ public:
+  DioSnapshotSlotCache(const std::string& key) :
+    key_(key), slot_(DioSnapshotSlot<T>::ForKey(key, true /* create */)) {}
+
+  // Returns the slot for key. Key may be a std::string or a C string; the
+  // usual case of an unchanged key compares it and doesn't allocate.
+  template <class Key>
+  DioSnapshotSlot<T>* ForKey(const Key& key) const {
+    if (key_ == key) {
+      return slot_;
+    }
+    return DioSnapshotSlot<T>::ForKey(key, true /* create */);
+  }
+
+ private:
+  const std::string key_;
+  DioSnapshotSlot<T>* const slot_;
+};
+
+// Lets the macros below deduce the type of the cache.
+template <class T>
+DioSnapshotSlotCache<T> DioSnapshotSlotCacheFor(const T& var,
+                                                const std::string& key) {
+  return DioSnapshotSlotCache<T>(key);
+}
+
+// This function gets or sets a snapshotted value, depending upon the
+// arguments. Looks up the key every time; the macros below avoid that.
 //
 // op : 0 means get, 1 means set.
 //
@@ -329,22 +1285,16 @@ typedef DioTest Diogenes;
 template <class T>
 const T* DioGetOrSetSnapshot(int op, const std::string& key,
     const T* val, bool* ok) {
-  static std::unordered_map<std::string, T> cache;
-
   if (op == 0) {
-    const auto& loc = cache.find(key);
-    if (loc != cache.end()) {
-      if (ok != nullptr) {
-        *ok = true;
-      }
-      return &(loc->second);
-    }
+    DioSnapshotSlot<T>* slot =
+        DioSnapshotSlot<T>::ForKey(key, false /* create */);
+    const T* value = (slot != nullptr) ? slot->Get() : nullptr;
     if (ok != nullptr) {
-      *ok = false;
+      *ok = (value != nullptr);
     }
-    return nullptr;
+    return value;
   } else if (op == 1) {
-    cache.insert({key, *val});
+    DioSnapshotSlot<T>::ForKey(key, true /* create */)->Set(*val);
     if (ok != nullptr) {
       *ok = true;
     }
@@ -387,13 +1337,13 @@ const T& DioGetSnapshottedValue(const std::string& key,
 template <class T>
 struct DioSnapshotOnExitClass {
   const T& varref;
-  const std::string& key;
+  DioSnapshotSlot<T>* slot;
 
-  DioSnapshotOnExitClass(const T& _varref, const std::string& _key) :
-    varref(_varref), key(_key) {};
+  DioSnapshotOnExitClass(const T& _varref, DioSnapshotSlot<T>* _slot) :
+    varref(_varref), slot(_slot) {};
 
   ~DioSnapshotOnExitClass() {
-    DioGetOrSetSnapshot(1, key, &varref, nullptr);
+    slot->Set(varref);
   }
 };
 
@@ -406,24 +1356,929 @@ struct DioSnapshotOnExitClass {
 template <class T>
 DioSnapshotOnExitClass<T> DioSnapshotOnExitFunction(const T& varname,
     const std::string& key) {
-  return DioSnapshotOnExitClass<T>(varname, key);
+  return DioSnapshotOnExitClass<T>(varname, DioSnapshotSlotFor(varname, key));
+}
+
+template <class T>
+DioSnapshotOnExitClass<T> DioSnapshotOnExitFunction(const T& varname,
+    DioSnapshotSlot<T>* slot) {
+  return DioSnapshotOnExitClass<T>(varname, slot);
 }
 
+#if !defined(DIO_DISABLE_SNAPSHOTS)
 // More syntax sugar to allow us to hide the explicit creation of
 // a variable. We can now write:
 //
 //   DioSnapshotOnExit(somevar, "key");
 //
 // Note the lack of the type of 'somevar' above.
-#define DioSnapshotOnExit(varname, key) auto capturer##varname = \
-    DioSnapshotOnExitFunction(varname, key);
+#define DioSnapshotOnExit(varname, key) \
+    const auto& dio_snapshot_key_##varname = (key); \
+    static const auto dio_snapshot_cache_##varname = \
+        DioSnapshotSlotCacheFor(varname, dio_snapshot_key_##varname); \
+    auto capturer##varname = DioSnapshotOnExitFunction( \
+        varname, \
+        dio_snapshot_cache_##varname.ForKey(dio_snapshot_key_##varname))
 
 // Syntax sugar to snapshot a variable immediately. We can now write:
 //
 //   DioSnapshot(somevar, "key");
 //
 // Note the lack of the type of 'somevar' above.
-#define DioSnapshot(varname, key) DioGetOrSetSnapshot(1 /* set */, key, \
-    &(varname), nullptr);
+#define DioSnapshot(varname, key) \
+    do { \
+      const auto& dio_snapshot_key = (key); \
+      static const auto dio_snapshot_cache = \
+          DioSnapshotSlotCacheFor(varname, dio_snapshot_key); \
+      dio_snapshot_cache.ForKey(dio_snapshot_key)->Set(varname); \
+    } while (0)
+#else
+// Snapshots compiled out. sizeof keeps varname counted as used without
+// evaluating anything.
+#define DioSnapshotOnExit(varname, key) static_cast<void>(sizeof(varname))
+#define DioSnapshot(varname, key) static_cast<void>(sizeof(varname))
+#endif
+
+// ================= Benchmarks =============
+// Benchmarks are written and registered like tests, next to the code they
+// measure:
+//
+//   DIOBENCH(BM_Foo) = [](DioBenchState& s) {
+//     while (s.KeepRunning()) {
+//       DioDoNotOptimize(Foo());
+//     }
+//   };
+//
+// They don't run with the tests. Run them with --diobench=all, or
+// --diobench=BM_Foo,bar.cc to run a subset, like --diofilter.
+
+// Keeps the compiler from optimizing away the computation of value, by
+// pretending to read it from a register or memory.
+template <class T>
+inline void DioDoNotOptimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Keeps the compiler from optimizing away or reordering writes to memory
+// across this point.
+inline void DioClobberMemory() {
+  asm volatile("" : : : "memory");
+}
+
+// Hardware performance counters of the calling thread, read through
+// perf_event_open(2): cycles, instructions, branch misses, and L1 data and
+// last level cache misses. Counters that can't be opened, e.g. in a VM
+// without a PMU or with a high perf_event_paranoid, are left out; error()
+// says why.
+class DioPerfCounters {
+ public:
+  // Opens the counters listed above, unless add_defaults is false.
+  explicit DioPerfCounters(bool add_defaults = true) {
+    if (!add_defaults) {
+      return;
+    }
+    Add("cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+    Add("instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+    Add("branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+    Add("L1-dcache-misses", PERF_TYPE_HW_CACHE,
+        PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+            (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    Add("LLC-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+  }
+
+  DioPerfCounters(const DioPerfCounters&) = delete;
+  DioPerfCounters& operator=(const DioPerfCounters&) = delete;
+
+  ~DioPerfCounters() {
+    for (const Counter& c : counters_) {
+      close(c.fd);
+    }
+  }
+
+  // True if at least one counter could be opened.
+  bool available() const { return !counters_.empty(); }
+
+  // Why the first counter that couldn't be opened wasn't, or empty.
+  const std::string& error() const { return error_; }
+
+  // Opens one more counter. type and config are as in perf_event_attr.
+  // Returns false if the counter can't be opened.
+  bool Add(const char* name, uint32_t type, uint64_t config) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format =
+        PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr,
+                                      0 /* this thread */, -1 /* any cpu */,
+                                      -1 /* no group */, 0));
+    if (fd < 0) {
+      if (error_.empty()) {
+        error_ = std::string(name) + ": " + strerror(errno);
+      }
+      return false;
+    }
+    counters_.push_back(Counter{name, fd});
+    return true;
+  }
+
+  void Reset() { Ioctl(PERF_EVENT_IOC_RESET); }
+  void Start() { Ioctl(PERF_EVENT_IOC_ENABLE); }
+  void Stop() { Ioctl(PERF_EVENT_IOC_DISABLE); }
+
+  // Counts since the last Reset, by counter name. When the kernel had to
+  // share the hardware between more counters than it has, counts are
+  // scaled up from the time each counter actually ran.
+  std::vector<std::pair<std::string, double>> Read() const {
+    std::vector<std::pair<std::string, double>> values;
+    for (const Counter& c : counters_) {
+      // value, time enabled, time running.
+      uint64_t data[3] = {0, 0, 0};
+      if (read(c.fd, data, sizeof(data)) != sizeof(data)) {
+        continue;
+      }
+      double value = data[0];
+      if ((data[2] > 0) && (data[2] < data[1])) {
+        value *= static_cast<double>(data[1]) / data[2];
+      }
+      values.emplace_back(c.name, value);
+    }
+    return values;
+  }
+
+ private:
+  struct Counter {
+    const char* name;
+    int fd;
+  };
+
+  void Ioctl(unsigned long request) {
+    for (const Counter& c : counters_) {
+      ioctl(c.fd, request, 0);
+    }
+  }
+
+  std::vector<Counter> counters_;
+  std::string error_;
+};
+
+// Passed to a benchmark. Runs the benchmark's loop for a chosen number of
+// iterations and times it.
+class DioBenchState {
+ public:
+  // If counters is not null, it counts while timing is on.
+  explicit DioBenchState(int64_t iterations,
+                         DioPerfCounters* counters = nullptr)
+      : iterations_(iterations), remaining_(iterations), counters_(counters) {}
+
+  // Returns true while the benchmark should do one more iteration. Timing
+  // starts at the first call and stops when this returns false.
+  bool KeepRunning() {
+    if (remaining_ > 0) {
+      if (remaining_ == iterations_) {
+        ResumeTiming();
+      }
+      --remaining_;
+      return true;
+    }
+    PauseTiming();
+    return false;
+  }
+
+  // Stops and restarts timing, to leave per-iteration setup out of the
+  // measurement. Each pair costs a few tens of nanoseconds, so only use
+  // them around setup that is much slower than that.
+  void PauseTiming() {
+    if (timing_) {
+      elapsed_ += std::chrono::steady_clock::now() - start_;
+      if (counters_ != nullptr) {
+        counters_->Stop();
+      }
+      const DioAllocations::Counts& now = DioAllocations::ThisThread();
+      allocations_ += now.allocations - allocations_start_.allocations;
+      allocated_bytes_ += now.bytes - allocations_start_.bytes;
+      timing_ = false;
+    }
+  }
+
+  void ResumeTiming() {
+    if (!timing_) {
+      if (counters_ != nullptr) {
+        counters_->Start();
+      }
+      allocations_start_ = DioAllocations::ThisThread();
+      start_ = std::chrono::steady_clock::now();
+      timing_ = true;
+    }
+  }
+
+  int64_t iterations() const { return iterations_; }
+
+  // Time measured so far, in nanoseconds.
+  double elapsed_ns() const {
+    return std::chrono::duration<double, std::nano>(elapsed_).count();
+  }
+
+  // Heap allocations made while timing, if counted. See DioAllocations.
+  int64_t allocations() const { return allocations_; }
+  int64_t allocated_bytes() const { return allocated_bytes_; }
+
+ private:
+  const int64_t iterations_;
+  int64_t remaining_;
+  DioPerfCounters* counters_;
+  bool timing_ = false;
+  std::chrono::steady_clock::time_point start_;
+  std::chrono::steady_clock::duration elapsed_{0};
+  DioAllocations::Counts allocations_start_;
+  int64_t allocations_ = 0;
+  int64_t allocated_bytes_ = 0;
+};
+
+// A single benchmark. Like DioTest, keeps track of all benchmarks created.
+class DioBench {
+ public:
+  typedef std::function<void(DioBenchState&)> Benchmark;
+
+  const char* filename = nullptr;
+  int linenum = -1;
+  const char* bench_name = nullptr;
+
+  // Create shell of a benchmark with only filename, line number, and name
+  // set. For use with the DIOBENCH macro below.
+  DioBench(const char* _filename, int _linenum, const char* _bench_name)
+      : filename(_filename), linenum(_linenum), bench_name(_bench_name) {
+    AllBenchmarks().push_back(this);
+  }
+
+  virtual ~DioBench() = default;
+
+  virtual void Run(DioBenchState& s) const = 0;
+
+  static std::vector<DioBench*>& AllBenchmarks() {
+    static std::vector<DioBench*> benchmarks;
+    return benchmarks;
+  }
+
+  // How RunAll runs benchmarks.
+  struct Options {
+    // "all", or benchmark names and filenames, as in DioTest::Filter.
+    std::string run_spec = "all";
+
+    // Number of timed samples to take of each benchmark.
+    int num_samples = 10;
+
+    // Roughly how long each sample should take. Iteration counts are chosen
+    // so a sample takes at least this long.
+    double sample_ms = 20;
+
+    // Also collect hardware performance counters, where available.
+    bool counters = true;
+  };
+
+  // Measurements of one benchmark.
+  struct Result {
+    std::string name;
+
+    // Iterations in each sample.
+    int64_t iterations = 0;
+
+    // Nanoseconds per iteration, one per sample.
+    std::vector<double> ns_per_op;
+
+    // Mean over all samples of each hardware counter per iteration, if
+    // counters were collected.
+    std::vector<std::pair<std::string, double>> counters_per_op;
+
+    // Mean heap allocations and allocated bytes per iteration, or -1 if
+    // allocations weren't counted. See DioAllocations.
+    double allocations_per_op = -1;
+    double bytes_per_op = -1;
+
+    // Returns the mean per iteration of the counter name, or -1 if it wasn't
+    // collected.
+    double CounterPerOp(const std::string& name) const {
+      for (const auto& counter : counters_per_op) {
+        if (counter.first == name) {
+          return counter.second;
+        }
+      }
+      return -1;
+    }
+
+    double Mean() const {
+      double sum = 0;
+      for (double x : ns_per_op) {
+        sum += x;
+      }
+      return ns_per_op.empty() ? 0 : sum / ns_per_op.size();
+    }
+
+    double Median() const {
+      if (ns_per_op.empty()) {
+        return 0;
+      }
+      std::vector<double> sorted = ns_per_op;
+      std::sort(sorted.begin(), sorted.end());
+      size_t n = sorted.size();
+      return (n % 2 == 1) ? sorted[n / 2]
+                          : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+    }
+
+    double StdDev() const {
+      if (ns_per_op.size() < 2) {
+        return 0;
+      }
+      double mean = Mean();
+      double sum_sq = 0;
+      for (double x : ns_per_op) {
+        sum_sq += (x - mean) * (x - mean);
+      }
+      return std::sqrt(sum_sq / (ns_per_op.size() - 1));
+    }
+
+    // Half the width of the 95% confidence interval of the mean, using
+    // Student's t distribution.
+    double ConfidenceInterval95() const {
+      if (ns_per_op.size() < 2) {
+        return 0;
+      }
+      return StudentT95(ns_per_op.size() - 1) * StdDev() /
+             std::sqrt(static_cast<double>(ns_per_op.size()));
+    }
+  };
+
+  // Two-sided 95% critical value of Student's t distribution with the given
+  // degrees of freedom.
+  static double StudentT95(int degrees_of_freedom) {
+    static const double kTable[] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201,  2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080,  2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042};
+    if (degrees_of_freedom < 1) {
+      return 0;
+    }
+    if (degrees_of_freedom <= 30) {
+      return kTable[degrees_of_freedom - 1];
+    }
+    return 1.96;
+  }
+
+  // Runs b once for iterations iterations and returns the time it took. If
+  // allocations is not null, adds the allocations made while timing to it.
+  static double TimeIterations(const DioBench* b, int64_t iterations,
+                               DioPerfCounters* counters = nullptr,
+                               DioAllocations::Counts* allocations = nullptr) {
+    DioBenchState s(iterations, counters);
+    b->Run(s);
+    if (allocations != nullptr) {
+      allocations->allocations += s.allocations();
+      allocations->bytes += s.allocated_bytes();
+    }
+    return s.elapsed_ns();
+  }
+
+  // Returns the mean per iteration of each counter, given the counters read
+  // after each sample (see DioPerfCounters::Read). Counters are matched by
+  // name, since one that fails to read is left out of its sample, and each is
+  // averaged over the samples it was read in. Counters are listed in the
+  // order they first appear.
+  static std::vector<std::pair<std::string, double>> MeanCountersPerOp(
+      const std::vector<std::vector<std::pair<std::string, double>>>& samples,
+      int64_t iterations) {
+    std::vector<std::pair<std::string, double>> means;
+    std::vector<int> num_samples;
+    for (const auto& sample : samples) {
+      for (const auto& counter : sample) {
+        size_t j = 0;
+        while ((j < means.size()) && (means[j].first != counter.first)) {
+          ++j;
+        }
+        if (j == means.size()) {
+          means.emplace_back(counter.first, 0);
+          num_samples.push_back(0);
+        }
+        means[j].second += counter.second / iterations;
+        ++num_samples[j];
+      }
+    }
+    for (size_t j = 0; j < means.size(); ++j) {
+      means[j].second /= num_samples[j];
+    }
+    return means;
+  }
+
+  // Finds an iteration count for which b takes at least sample_ms, then takes
+  // num_samples samples with that count.
+  static Result Measure(const DioBench* b, const Options& options) {
+    const double target_ns = options.sample_ms * 1e6;
+    const int64_t kMaxIterations = 1000000000;
+    int64_t iterations = 1;
+    for (;;) {
+      double elapsed_ns = TimeIterations(b, iterations);
+      if ((elapsed_ns >= target_ns) || (iterations >= kMaxIterations)) {
+        break;
+      }
+      // Aim a bit past the target, but grow at most 100x per step in case
+      // the first iterations were unusually fast.
+      double factor = (elapsed_ns > 0) ? 1.4 * target_ns / elapsed_ns : 100;
+      factor = std::min(100.0, std::max(2.0, factor));
+      iterations = std::min(
+          kMaxIterations, static_cast<int64_t>(std::ceil(iterations * factor)));
+    }
+
+    Result result;
+    result.name = b->bench_name;
+    result.iterations = iterations;
+    std::unique_ptr<DioPerfCounters> counters;
+    if (options.counters) {
+      counters.reset(new DioPerfCounters());
+      if (!counters->available()) {
+        counters.reset();
+      }
+    }
+    DioAllocations::Counts allocations;
+    std::vector<std::vector<std::pair<std::string, double>>> counter_samples;
+    for (int i = 0; i < options.num_samples; ++i) {
+      if (counters) {
+        counters->Reset();
+      }
+      result.ns_per_op.push_back(
+          TimeIterations(b, iterations, counters.get(), &allocations) /
+          iterations);
+      if (counters) {
+        counter_samples.push_back(counters->Read());
+      }
+    }
+    result.counters_per_op = MeanCountersPerOp(counter_samples, iterations);
+    if (DioAllocations::hooked() && (options.num_samples > 0)) {
+      double total_iterations =
+          static_cast<double>(iterations) * options.num_samples;
+      result.allocations_per_op = allocations.allocations / total_iterations;
+      result.bytes_per_op = allocations.bytes / total_iterations;
+    }
+    return result;
+  }
+
+  // Prints a result like:
+  //   Benchmark BM_Foo: 12.31 ns/op +- 0.08 (95% CI, 10 samples of 2000000)
+  //     per op: 41.20 cycles, 98.00 instructions (IPC 2.38), ...
+  //     per op: 2.00 allocations, 64.00 bytes allocated
+  static void PrintResult(const Result& result) {
+    std::ostringstream os;
+    os << std::fixed << std::setprecision(2) << "Benchmark " << result.name
+       << ": " << result.Mean() << " ns/op +- "
+       << result.ConfidenceInterval95() << " (95% CI, "
+       << result.ns_per_op.size() << " samples of " << result.iterations
+       << ")";
+    if (!result.counters_per_op.empty()) {
+      os << "\n  per op:";
+      const char* separator = " ";
+      for (const auto& counter : result.counters_per_op) {
+        os << separator << counter.second << " " << counter.first;
+        if ((counter.first == "instructions") &&
+            (result.CounterPerOp("cycles") > 0)) {
+          os << " (IPC " << counter.second / result.CounterPerOp("cycles")
+             << ")";
+        }
+        separator = ", ";
+      }
+    }
+    if (result.allocations_per_op >= 0) {
+      os << "\n  per op: " << result.allocations_per_op << " allocations, "
+         << result.bytes_per_op << " bytes allocated";
+    }
+    std::cout << os.str() << std::endl;
+  }
+
+  // Runs the benchmarks selected by options.run_spec, one after the other,
+  // and prints their results.
+  static std::vector<Result> RunAll(const Options& options) {
+    if (options.counters) {
+      DioPerfCounters probe;
+      if (!probe.error().empty()) {
+        std::cout << "Some hardware counters are unavailable ("
+                  << probe.error() << ")" << std::endl;
+      }
+    }
+    const DioTest::Filter filter(options.run_spec);
+    std::vector<Result> results;
+    for (const DioBench* b : AllBenchmarks()) {
+      if ((options.run_spec == "all") ||
+          filter.Selects(b->bench_name, b->filename)) {
+        results.push_back(Measure(b, options));
+        PrintResult(results.back());
+      }
+    }
+    std::cout << "Diogenes benchmarks: Ran " << results.size()
+              << " benchmarks." << std::endl;
+    return results;
+  }
+
+  // ---- Baselines: saving results and comparing against them ----
+
+  // Writes results as JSON, in a format meant to be kept, e.g.:
+  //
+  //   {"format": "diobench-1", "benchmarks": [
+  //     {"name": "BM_Foo", "iterations": 2000000,
+  //      "ns_per_op": [12.3, 12.4, ...],
+  //      "counters_per_op": {"cycles": 41.2, ...},
+  //      "allocations_per_op": 2, "bytes_per_op": 64},
+  //     ...]}
+  //
+  // All samples are kept so later runs can be compared against them with a
+  // statistical test rather than by their means alone.
+  static std::string ToJson(const std::vector<Result>& results) {
+    std::ostringstream os;
+    os << std::setprecision(9);
+    os << "{\"format\": \"diobench-1\", \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); ++i) {
+      const Result& r = results[i];
+      os << (i == 0 ? "\n" : ",\n") << "  {\"name\": \"" << JsonEscape(r.name)
+         << "\", \"iterations\": " << r.iterations << ",\n   \"ns_per_op\": [";
+      for (size_t j = 0; j < r.ns_per_op.size(); ++j) {
+        os << (j == 0 ? "" : ", ") << r.ns_per_op[j];
+      }
+      os << "],\n   \"counters_per_op\": {";
+      for (size_t j = 0; j < r.counters_per_op.size(); ++j) {
+        os << (j == 0 ? "" : ", ") << "\""
+           << JsonEscape(r.counters_per_op[j].first)
+           << "\": " << r.counters_per_op[j].second;
+      }
+      os << "}";
+      if (r.allocations_per_op >= 0) {
+        os << ",\n   \"allocations_per_op\": " << r.allocations_per_op
+           << ", \"bytes_per_op\": " << r.bytes_per_op;
+      }
+      os << "}";
+    }
+    os << "\n]}\n";
+    return os.str();
+  }
+
+  // Reads results written by ToJson. Returns false, and sets error, if json
+  // isn't in that format. Unknown fields are skipped, so newer files with
+  // more fields can still be read.
+  static bool FromJson(const std::string& json, std::vector<Result>* results,
+                       std::string* error) {
+    JsonReader reader{json, 0, ""};
+    results->clear();
+    std::string format;
+    bool ok = reader.Object([&](const std::string& key) {
+      if (key == "format") {
+        return reader.String(&format);
+      } else if (key == "benchmarks") {
+        return reader.Array([&]() {
+          Result r;
+          bool ok = reader.Object([&](const std::string& key) {
+            double number = 0;
+            if (key == "name") {
+              return reader.String(&r.name);
+            } else if (key == "iterations") {
+              bool ok = reader.Number(&number);
+              r.iterations = static_cast<int64_t>(number);
+              return ok;
+            } else if (key == "ns_per_op") {
+              return reader.Array([&]() {
+                bool ok = reader.Number(&number);
+                r.ns_per_op.push_back(number);
+                return ok;
+              });
+            } else if (key == "counters_per_op") {
+              return reader.Object([&](const std::string& counter) {
+                bool ok = reader.Number(&number);
+                r.counters_per_op.emplace_back(counter, number);
+                return ok;
+              });
+            } else if (key == "allocations_per_op") {
+              return reader.Number(&r.allocations_per_op);
+            } else if (key == "bytes_per_op") {
+              return reader.Number(&r.bytes_per_op);
+            }
+            return reader.Skip();
+          });
+          results->push_back(r);
+          return ok;
+        });
+      }
+      return reader.Skip();
+    });
+    if (ok && (format != "diobench-1")) {
+      reader.error = "unknown format '" + format + "'";
+      ok = false;
+    }
+    if (!ok && (error != nullptr)) {
+      *error = reader.error;
+    }
+    return ok;
+  }
+
+  // Writes results to the file path as JSON. Returns false, and sets error,
+  // if the file can't be written.
+  static bool SaveResults(const std::string& path,
+                          const std::vector<Result>& results,
+                          std::string* error) {
+    std::ofstream out(path);
+    out << ToJson(results);
+    out.close();
+    if (!out) {
+      *error = "can't write " + path;
+      return false;
+    }
+    return true;
+  }
+
+  // Reads results saved by SaveResults. Returns false, and sets error, if
+  // the file can't be read or parsed.
+  static bool LoadResults(const std::string& path,
+                          std::vector<Result>* results, std::string* error) {
+    std::ifstream in(path);
+    if (!in) {
+      *error = "can't read " + path;
+      return false;
+    }
+    std::stringstream contents;
+    contents << in.rdbuf();
+    if (!FromJson(contents.str(), results, error)) {
+      *error = path + ": " + *error;
+      return false;
+    }
+    return true;
+  }
+
+  // Two-sided p-value of the Mann-Whitney U test that samples a and b come
+  // from the same distribution. Unlike a t-test, doesn't assume timings are
+  // normally distributed, which they usually aren't: they have a long tail
+  // from interrupts and other processes. Uses the normal approximation with
+  // tie and continuity corrections, which is good enough from about 8
+  // samples each.
+  static double MannWhitneyPValue(const std::vector<double>& a,
+                                  const std::vector<double>& b) {
+    size_t n1 = a.size();
+    size_t n2 = b.size();
+    if ((n1 == 0) || (n2 == 0)) {
+      return 1;
+    }
+    // Rank all samples together, giving ties the average of their ranks.
+    std::vector<std::pair<double, int>> all;
+    for (double x : a) {
+      all.emplace_back(x, 0);
+    }
+    for (double x : b) {
+      all.emplace_back(x, 1);
+    }
+    std::sort(all.begin(), all.end());
+    size_t n = all.size();
+    double rank_sum_a = 0;
+    double tie_term = 0;
+    for (size_t i = 0; i < n;) {
+      size_t j = i;
+      while ((j < n) && (all[j].first == all[i].first)) {
+        ++j;
+      }
+      double average_rank = (i + 1 + j) / 2.0;
+      for (size_t k = i; k < j; ++k) {
+        if (all[k].second == 0) {
+          rank_sum_a += average_rank;
+        }
+      }
+      double t = j - i;
+      tie_term += t * t * t - t;
+      i = j;
+    }
+    double u = rank_sum_a - n1 * (n1 + 1) / 2.0;
+    double mean = n1 * n2 / 2.0;
+    double variance = n1 * n2 / 12.0 *
+                      ((n + 1) - tie_term / (static_cast<double>(n) * (n - 1)));
+    if (variance <= 0) {
+      return 1;
+    }
+    double z = std::max(0.0, std::fabs(u - mean) - 0.5) / std::sqrt(variance);
+    return std::erfc(z / std::sqrt(2.0));
+  }
+
+  // How a benchmark changed from a baseline.
+  struct Comparison {
+    std::string name;
+    double baseline_ns = 0;
+    double current_ns = 0;
+
+    // current_ns / baseline_ns - 1. E.g., 0.10 means 10% slower.
+    double change = 0;
+
+    double p_value = 1;
+
+    // Significantly slower by more than the threshold.
+    bool regression = false;
+  };
+
+  // Compares the benchmarks in current to those of the same name in
+  // baseline, by their medians. A benchmark regressed if it got slower by
+  // more than threshold (0.05 means 5%) and the Mann-Whitney test says the
+  // difference is significant at level alpha. Benchmarks only in one of
+  // the two are ignored.
+  static std::vector<Comparison> Compare(const std::vector<Result>& baseline,
+                                         const std::vector<Result>& current,
+                                         double threshold, double alpha) {
+    std::vector<Comparison> comparisons;
+    for (const Result& cur : current) {
+      for (const Result& base : baseline) {
+        if (base.name != cur.name) {
+          continue;
+        }
+        Comparison c;
+        c.name = cur.name;
+        c.baseline_ns = base.Median();
+        c.current_ns = cur.Median();
+        c.change = (c.baseline_ns > 0) ? c.current_ns / c.baseline_ns - 1 : 0;
+        c.p_value = MannWhitneyPValue(base.ns_per_op, cur.ns_per_op);
+        c.regression = (c.change > threshold) && (c.p_value < alpha);
+        comparisons.push_back(c);
+        break;
+      }
+    }
+    return comparisons;
+  }
+
+  // Prints comparisons, one per line, like:
+  //   Compare BM_Foo: 12.30 -> 14.10 ns/op (+14.6%, p=0.0002) REGRESSION
+  // Returns the number of regressions.
+  static int PrintComparisons(const std::vector<Comparison>& comparisons) {
+    int num_regressions = 0;
+    for (const Comparison& c : comparisons) {
+      std::ostringstream os;
+      os << std::fixed << std::setprecision(2) << "Compare " << c.name << ": "
+         << c.baseline_ns << " -> " << c.current_ns << " ns/op ("
+         << std::showpos << c.change * 100 << std::noshowpos << "%, p="
+         << std::setprecision(4) << c.p_value << ")";
+      if (c.regression) {
+        os << " REGRESSION";
+        ++num_regressions;
+      }
+      std::cout << os.str() << std::endl;
+    }
+    std::cout << "Diogenes benchmarks: " << num_regressions << " of "
+              << comparisons.size() << " compared benchmarks regressed."
+              << std::endl;
+    return num_regressions;
+  }
+
+ private:
+  static std::string JsonEscape(const std::string& s) {
+    std::string escaped;
+    for (char c : s) {
+      if ((c == '"') || (c == '\\')) {
+        escaped += '\\';
+      }
+      escaped += c;
+    }
+    return escaped;
+  }
+
+  // Just enough of a JSON parser to read what ToJson writes, and to skip
+  // anything else.
+  struct JsonReader {
+    const std::string& json;
+    size_t pos;
+    std::string error;
+
+    bool Fail(const std::string& what) {
+      if (error.empty()) {
+        error = what + " at offset " + std::to_string(pos);
+      }
+      return false;
+    }
+
+    void SkipSpace() {
+      while ((pos < json.size()) && isspace(json[pos])) {
+        ++pos;
+      }
+    }
+
+    bool Consume(char c) {
+      SkipSpace();
+      if ((pos < json.size()) && (json[pos] == c)) {
+        ++pos;
+        return true;
+      }
+      return false;
+    }
+
+    bool String(std::string* out) {
+      if (!Consume('"')) {
+        return Fail("expected string");
+      }
+      out->clear();
+      while ((pos < json.size()) && (json[pos] != '"')) {
+        if ((json[pos] == '\\') && (pos + 1 < json.size())) {
+          ++pos;
+        }
+        *out += json[pos++];
+      }
+      return Consume('"') || Fail("unterminated string");
+    }
+
+    bool Number(double* out) {
+      SkipSpace();
+      const char* start = json.c_str() + pos;
+      char* end = nullptr;
+      *out = strtod(start, &end);
+      if (end == start) {
+        return Fail("expected number");
+      }
+      pos += end - start;
+      return true;
+    }
+
+    // Calls element() for each element of an array.
+    template <class Element>
+    bool Array(Element element) {
+      if (!Consume('[')) {
+        return Fail("expected array");
+      }
+      if (Consume(']')) {
+        return true;
+      }
+      do {
+        if (!element()) {
+          return false;
+        }
+      } while (Consume(','));
+      return Consume(']') || Fail("expected ']'");
+    }
+
+    // Calls member(key) for each member of an object, to read its value.
+    template <class Member>
+    bool Object(Member member) {
+      if (!Consume('{')) {
+        return Fail("expected object");
+      }
+      if (Consume('}')) {
+        return true;
+      }
+      do {
+        std::string key;
+        if (!String(&key) || !(Consume(':') || Fail("expected ':'")) ||
+            !member(key)) {
+          return false;
+        }
+      } while (Consume(','));
+      return Consume('}') || Fail("expected '}'");
+    }
+
+    // Skips any value.
+    bool Skip() {
+      SkipSpace();
+      if (pos >= json.size()) {
+        return Fail("expected value");
+      }
+      std::string ignored_string;
+      double ignored_number;
+      switch (json[pos]) {
+        case '"':
+          return String(&ignored_string);
+        case '[':
+          return Array([&]() { return Skip(); });
+        case '{':
+          return Object([&](const std::string&) { return Skip(); });
+        default:
+          for (const char* word : {"true", "false", "null"}) {
+            if (json.compare(pos, strlen(word), word) == 0) {
+              pos += strlen(word);
+              return true;
+            }
+          }
+          return Number(&ignored_number);
+      }
+    }
+  };
+};
+
+// Registers a benchmark. Usage:
+//
+//   DIOBENCH(BM_Foo) = [](DioBenchState& s) {
+//     while (s.KeepRunning()) {
+//       ...
+//     }
+//   };
+//
+// Works like DIOTEST.
+#define DIOBENCH(bench_name) \
+struct bench_name##_Class : public DioBench { \
+  static DioBench::Benchmark l; \
+  void Run(DioBenchState& s) const override { \
+    l(s); \
+  } \
+  bench_name##_Class(const char *filename, int linenum, const char *name) \
+      : DioBench(filename, linenum, name){}; \
+}; \
+\
+static bench_name##_Class bench_name(__FILE__, __LINE__, #bench_name); \
+DioBench::Benchmark bench_name##_Class::l \
 
 #endif
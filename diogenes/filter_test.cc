@@ -0,0 +1,106 @@
+// Tests of selecting tests with --diofilter. Try, e.g.:
+//
+//   ./filter_test_main --diofilter='Test_Glob*,-Test_GlobMatch'
+#include <string>
+#include <vector>
+
+static bool Selects(const std::string& run_spec, const char* name,
+                    const char* filename = "dir/foo_test.cc") {
+  return DioTest::Filter(run_spec).Selects(name, filename);
+}
+
+DIOTEST(Test_ExactNames) = []() {
+  DioExpect(Selects("Test_A", "Test_A"));
+  DioExpect(Selects("Test_B, Test_A", "Test_A"));
+  // No more matching of substrings.
+  DioExpect(!Selects("Test_A", "Test_AB"));
+  DioExpect(!Selects("Test_AB", "Test_A"));
+  DioExpect(!Selects("Test_A", nullptr, nullptr));
+};
+
+DIOTEST(Test_Filenames) = []() {
+  DioExpect(Selects("foo_test.cc", "Test_A"));
+  DioExpect(Selects("dir/foo_test.cc", "Test_A"));
+  DioExpect(!Selects("o_test.cc", "Test_A"));
+  DioExpect(!Selects("foo_test.cc", "Test_A", "bar_test.cc"));
+  DioExpect(Selects("*_test.cc", "Test_A", "bar_test.cc"));
+};
+
+DIOTEST(Test_Globs) = []() {
+  DioExpect(Selects("Test_A*", "Test_AB"));
+  DioExpect(Selects("Test_A*", "Test_A"));
+  DioExpect(!Selects("Test_A*", "Test_BA"));
+  DioExpect(Selects("*B", "Test_AB"));
+  DioExpect(Selects("Test_?B", "Test_AB"));
+  DioExpect(!Selects("Test_?B", "Test_B"));
+};
+
+DIOTEST(Test_GlobMatch) = []() {
+  using Filter = DioTest::Filter;
+  DioExpect(Filter::GlobMatch("", ""));
+  DioExpect(Filter::GlobMatch("*", ""));
+  DioExpect(!Filter::GlobMatch("?", ""));
+  DioExpect(Filter::GlobMatch("a*b*c", "aXbYbZc"));
+  DioExpect(!Filter::GlobMatch("a*b*c", "aXbYbZ"));
+  DioExpect(Filter::GlobMatch("*aab", "aaaab"));
+  DioExpect(Filter::GlobMatch("**x", "x"));
+};
+
+DIOTEST(Test_Regexes) = []() {
+  DioExpect(Selects("re:Test_[0-9]+", "Test_42"));
+  // The whole name must match.
+  DioExpect(!Selects("re:Test_[0-9]+", "Test_42x"));
+  DioExpect(Selects("re:.*_test\\.cc", "Test_A"));
+
+  DioTest::Filter bad("Test_A,re:Test_[");
+  DioExpect(!bad.error().empty());
+  DioExpect(DioTest::Filter("re:a|b").error().empty());
+};
+
+DIOTEST(Test_Exclusions) = []() {
+  DioExpect(!Selects("Test_A*,-Test_AB", "Test_AB"));
+  DioExpect(Selects("Test_A*,-Test_AB", "Test_AC"));
+  // With only exclusions, everything else is selected, unnamed tests too.
+  DioExpect(Selects("-Test_Slow*", "Test_A"));
+  DioExpect(!Selects("-Test_Slow*", "Test_Slow1"));
+  DioExpect(Selects("-Test_Slow*", nullptr, nullptr));
+  DioExpect(!Selects("-foo_test.cc", "Test_A"));
+
+  DioExpect(DioTest::Filter("").SelectsAll());
+  DioExpect(DioTest::Filter(" , ").SelectsAll());
+  DioExpect(!DioTest::Filter("-x").SelectsAll());
+};
+
+// Names like those of a huge generated test suite.
+static const std::vector<std::string>& ManyTestNames() {
+  static std::vector<std::string> names;
+  if (names.empty()) {
+    for (int i = 0; i < 50000; ++i) {
+      names.push_back("Test_Generated" + std::to_string(i));
+    }
+  }
+  return names;
+}
+
+static const char kPickSome[] =
+    "Test_Generated7,Test_Generated42,Test_Generated49999,Test_Generated4200*";
+
+DIOTEST(Test_SelectFromManyTests) = []() {
+  DioTest::Filter filter(kPickSome);
+  int num_selected = 0;
+  for (const std::string& name : ManyTestNames()) {
+    num_selected += filter.Selects(name.c_str(), "generated_test.cc");
+  }
+  // The glob matches Test_Generated4200 and Test_Generated42000-42009.
+  DioExpect(num_selected == 3 + 11);
+};
+
+DIOBENCH(BM_FilterManyTests) = [](DioBenchState& s) {
+  const std::vector<std::string>& names = ManyTestNames();
+  DioTest::Filter filter(kPickSome);
+  size_t i = 0;
+  while (s.KeepRunning()) {
+    DioDoNotOptimize(filter.Selects(names[i].c_str(), "generated_test.cc"));
+    i = (i + 1 < names.size()) ? i + 1 : 0;
+  }
+};
@@ -0,0 +1,96 @@
+// Tests of running tests in child processes. Run them, and any other test
+// binary, isolated with:
+//
+//   ./isolate_test_main --dio_isolate=true
+#include <csignal>
+#include <cstdlib>
+
+static int global_counter = 0;
+
+// The tests below make tests that should only run when passed to RunIsolated
+// directly. Each removes the test it just made from AllTests again.
+DIOTEST(Test_IsolatedCrashIsReported) = []() {
+  DioTest crashing = []() { std::abort(); };
+  DioTest exiting = []() { std::exit(3); };
+  DioTest passing = []() { DioExpect(true); };
+  DioTest::AllTests().resize(DioTest::AllTests().size() - 3);
+  std::vector<DioTest::Result> results(3);
+  DioTest::RunIsolated({&crashing, &exiting, &passing}, 2, &results);
+
+  DioExpect(results[0].crash.find("signal " + std::to_string(SIGABRT)) !=
+            std::string::npos);
+  DioExpect(results[1].crash == "exited with status 3 before reporting");
+  DioExpect(results[2].crash.empty());
+  DioExpect(results[2].num_passed_expects == 1);
+  DioExpect(results[2].num_failed_expects == 0);
+};
+
+DIOTEST(Test_IsolatedChangesStayInChild) = []() {
+  DioTest changing = []() {
+    global_counter = 42;
+    DioExpect(global_counter == 42);
+  };
+  DioTest::AllTests().pop_back();
+  std::vector<DioTest::Result> results(1);
+  DioTest::RunIsolated({&changing}, 1, &results);
+  DioExpect(results[0].crash.empty());
+  DioExpect(results[0].num_passed_expects == 1);
+  DioExpect(global_counter == 0);
+};
+
+DIOTEST(Test_IsolatedTimeout) = []() {
+  DioTest hanging = []() {
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+  };
+  DioTest quick = []() { DioExpect(true); };
+  DioTest::AllTests().resize(DioTest::AllTests().size() - 2);
+  std::vector<DioTest::Result> results(2);
+  auto start = std::chrono::steady_clock::now();
+  DioTest::RunIsolated({&hanging, &quick}, 2, &results, 100 /* timeout_ms */);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  DioExpect(results[0].crash == "timed out after 100 ms");
+  DioExpect(results[0].wall_ms >= 100);
+  DioExpect(results[1].crash.empty());
+  DioExpect(elapsed < std::chrono::seconds(5));
+};
+
+// A grandchild keeps the pipe of its child open after the child has exited.
+DIOTEST(Test_IsolatedChildDiesWhilePipeStaysOpen) = []() {
+  DioTest leaving = []() {
+    if (fork() == 0) {
+      // Don't keep the output of the test binary open either.
+      close(STDOUT_FILENO);
+      close(STDERR_FILENO);
+      std::this_thread::sleep_for(std::chrono::seconds(3));
+      _exit(0);
+    }
+    std::exit(4);
+  };
+  DioTest::AllTests().pop_back();
+  std::vector<DioTest::Result> results(1);
+  auto start = std::chrono::steady_clock::now();
+  DioTest::RunIsolated({&leaving}, 1, &results);
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  DioExpect(results[0].crash == "exited with status 4 before reporting");
+  DioExpect(elapsed < std::chrono::seconds(2));
+};
+
+// A test running in the process can't be stopped, so the watchdog ends the
+// process. Run it in a child to see that.
+DIOTEST(Test_WatchdogEndsRun) = []() {
+  DioTest watched = []() {
+    DioTest hanging = []() {};
+    DioTest::AllTests().pop_back();
+    std::vector<DioTest*> tests = {&hanging};
+    DioTest::Watchdog watchdog(tests, 50 /* timeout_ms */);
+    watchdog.Started(0);
+    std::this_thread::sleep_for(std::chrono::seconds(10));
+  };
+  DioTest::AllTests().pop_back();
+  std::vector<DioTest::Result> results(1);
+  DioTest::RunIsolated({&watched}, 1, &results);
+  DioExpect(results[0].crash == "exited with status 1 before reporting");
+  DioExpect(results[0].wall_ms < 5000);
+};
@@ -0,0 +1,52 @@
+// Independent tests that take a while each. Run them in parallel with:
+//
+//   ./parallel_test_main --dio_jobs=4
+//
+// Results are reported in the same order as with --dio_jobs=1.
+#include <chrono>
+#include <thread>
+
+static void SleepMs(int ms) {
+  std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+DIOTEST(Test_Slow1) = []() {
+  SleepMs(100);
+  DioExpect(1 + 1 == 2);
+};
+
+DIOTEST(Test_Slow2) = []() {
+  SleepMs(100);
+  DioExpect(2 + 2 == 4);
+  DioExpect(3 + 3 == 6);
+};
+
+DIOTEST(Test_Slow3) = []() {
+  SleepMs(100);
+  DioExpect(string("ab") + "c" == "abc");
+};
+
+// Expects are attributed to the test that made them, even when tests run at
+// the same time on different threads.
+DIOTEST(Test_ExpectsCountedPerTest) = []() {
+  DioTest::Result* result = DioTest::CurrentResult();
+  DioExpect(result != nullptr);
+  SleepMs(50);
+  DioExpect(result->num_passed_expects == 1);
+  DioExpect(DioTest::CurrentResult() == result);
+};
+
+static DioTest Test_Unnamed = []() {
+  SleepMs(100);
+  DioExpect(true);
+};
+
+DIOTEST(Test_TimesRecorded) = []() {
+  DioTest sleeping = []() { SleepMs(30); };
+  DioTest::AllTests().pop_back();
+  DioTest::Result result;
+  sleeping.RunAndRecord(&result);
+  DioExpect(result.wall_ms >= 30);
+  // Sleeping doesn't use the CPU.
+  DioExpect(result.cpu_ms < result.wall_ms);
+};
@@ -0,0 +1,48 @@
+// Tests of sharding. Run one shard of these, or of any other test binary,
+// with:
+//
+//   ./shard_test_main --dio_shard_index=1 --dio_total_shards=3
+//   DIO_SHARD_INDEX=1 DIO_TOTAL_SHARDS=3 ./shard_test_main
+#include <set>
+
+DIOTEST(Test_StableHashIsFnv1a) = []() {
+  DioExpect(DioTest::StableHash("") == 0xcbf29ce484222325ULL);
+  DioExpect(DioTest::StableHash("a") == 0xaf63dc4c8601ec8cULL);
+  DioExpect(DioTest::StableHash("foobar") == 0x85944171f73967e8ULL);
+};
+
+DIOTEST(Test_ShardKeyIsTestName) = []() {
+  for (const DioTest* t : DioTest::AllTests()) {
+    if (t->test_name != nullptr) {
+      DioExpect(t->ShardKey() == t->test_name);
+    }
+  }
+};
+
+static DioTest Test_UnnamedA = []() {
+  DioExpect(true);
+};
+
+static DioTest Test_UnnamedB = []() {
+  DioExpect(true);
+};
+
+DIOTEST(Test_UnnamedTestsHaveDistinctShardKeys) = []() {
+  DioExpect(!Test_UnnamedA.ShardKey().empty());
+  DioExpect(Test_UnnamedA.ShardKey() != Test_UnnamedB.ShardKey());
+};
+
+DIOTEST(Test_EveryTestInExactlyOneShard) = []() {
+  const int num_shards = 3;
+  std::set<int> shards_used;
+  for (const DioTest* t : DioTest::AllTests()) {
+    int shard = DioTest::ShardOf(t, num_shards);
+    DioExpect((shard >= 0) && (shard < num_shards));
+    DioExpect(DioTest::ShardOf(t, num_shards) == shard);
+    shards_used.insert(shard);
+  }
+  DioExpect(shards_used.size() > 1);
+  for (const DioTest* t : DioTest::AllTests()) {
+    DioExpect(DioTest::ShardOf(t, 1) == 0);
+  }
+};
@@ -0,0 +1,113 @@
+// Tests of snapshotting variables. The Makefile also builds them with
+// -DDIO_DISABLE_SNAPSHOTS, as snapshot_off_test_main, where snapshots
+// compile to nothing.
+#include <atomic>
+#include <thread>
+
+// Snapshots the same way a hot function in production code would.
+static int Accumulate(int x) {
+  int doubled = 2 * x;
+  DioSnapshot(doubled, "Accumulate.doubled");
+  DioSnapshotOnExit(x, "Accumulate.x_on_exit");
+  x += doubled;
+  return x;
+}
+
+#if !defined(DIO_DISABLE_SNAPSHOTS)
+DIOTEST(Test_FirstSnapshotIsKept) = []() {
+  Accumulate(5);
+  Accumulate(7);
+  DioExpect(DioGetSnapshottedValue<int>("Accumulate.doubled") == 10);
+  DioExpect(DioGetSnapshottedValue<int>("Accumulate.x_on_exit") == 15);
+};
+
+DIOTEST(Test_SnapshotKeysArePerType) = []() {
+  std::string name = "ada";
+  DioSnapshot(name, "Test_SnapshotKeysArePerType");
+  double ratio = 0.5;
+  DioSnapshot(ratio, "Test_SnapshotKeysArePerType");
+  DioExpect(DioGetSnapshottedValue<std::string>(
+                "Test_SnapshotKeysArePerType") == "ada");
+  DioExpect(DioGetSnapshottedValue<double>("Test_SnapshotKeysArePerType") ==
+            0.5);
+
+  bool found = true;
+  DioGetOrSetSnapshot(0 /* get */, "Test_SnapshotKeysArePerType",
+                      static_cast<const int*>(nullptr), &found);
+  DioExpect(!found);
+};
+
+// Keys may change from call to call; each key gets its own slot.
+DIOTEST(Test_DynamicKeys) = []() {
+  for (int i = 0; i < 3; ++i) {
+    int square = i * i;
+    DioGetOrSetSnapshot(1 /* set */, "square" + std::to_string(i), &square,
+                        nullptr);
+  }
+  DioExpect(DioGetSnapshottedValue<int>("square2") == 4);
+  DioExpect(DioGetSnapshottedValue<int>("square1") == 1);
+
+  for (int i = 0; i < 3; ++i) {
+    int cube = i * i * i;
+    DioSnapshot(cube, "cube" + std::to_string(i));
+    int negated = -i;
+    DioSnapshotOnExit(negated, "negated" + std::to_string(i));
+  }
+  DioExpect(DioGetSnapshottedValue<int>("cube0") == 0);
+  DioExpect(DioGetSnapshottedValue<int>("cube1") == 1);
+  DioExpect(DioGetSnapshottedValue<int>("cube2") == 8);
+  DioExpect(DioGetSnapshottedValue<int>("negated2") == -2);
+  DioExpect(DioGetSnapshottedValue<int>("negated1") == -1);
+};
+
+// Threads racing to snapshot the same key all see the same, complete value.
+DIOTEST(Test_SnapshotFromThreads) = []() {
+  std::atomic<bool> start{false};
+  std::vector<std::thread> threads;
+  for (int t = 1; t <= 8; ++t) {
+    threads.emplace_back([&start, t]() {
+      while (!start) {
+      }
+      std::vector<int> values(1000, t);
+      DioSnapshot(values, "Test_SnapshotFromThreads");
+    });
+  }
+  start = true;
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  const auto& values =
+      DioGetSnapshottedValue<std::vector<int>>("Test_SnapshotFromThreads");
+  DioExpect(values.size() == 1000);
+  DioExpect(std::count(values.begin(), values.end(), values[0]) == 1000);
+};
+
+// Once filled, a snapshot doesn't hash, allocate or copy.
+DIOTEST(Test_FilledSnapshotDoesNotAllocate) = []() {
+  Accumulate(1);
+  DioResetAllocations();
+  int sum = 0;
+  for (int i = 0; i < 100; ++i) {
+    sum += Accumulate(i);
+  }
+  DioExpectAllocationsAtMost(0);
+  DioExpect(sum == 3 * 99 * 100 / 2);
+};
+#else
+DIOTEST(Test_SnapshotsCompiledOut) = []() {
+  DioExpect(Accumulate(5) == 15);
+  bool found = true;
+  DioGetOrSetSnapshot(0 /* get */, "Accumulate.doubled",
+                      static_cast<const int*>(nullptr), &found);
+  DioExpect(!found);
+};
+#endif
+
+// Compare with and without -DDIO_DISABLE_SNAPSHOTS:
+//   DIOBENCH=all ./snapshot_test_main; DIOBENCH=all ./snapshot_off_test_main
+DIOBENCH(BM_AccumulateWithSnapshots) = [](DioBenchState& s) {
+  int i = 0;
+  while (s.KeepRunning()) {
+    DioDoNotOptimize(Accumulate(++i));
+  }
+};
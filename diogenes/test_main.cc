@@ -6,14 +6,119 @@
 // Until I get around using different test runners, the ugly define
 // checks are used to disable features when they are declared as
 // unavailable.
+
+// Count heap allocations per test and per benchmark. Opt in with
+// -DDIO_COUNT_ALLOCATIONS, since it replaces the global operator new.
+#if defined(DIO_COUNT_ALLOCATIONS)
+DIO_DEFINE_ALLOCATION_HOOK;
+#endif
+
 #if !defined(DONT_INCLUDE_FLAGS)
+// Run only these tests: names, filenames, globs and regular expressions,
+// e.g. "Test_Foo,bar.cc,Test_Baz*,re:Test_[0-9]+,-Test_Slow*". See
+// DioTest::Filter.
 define_flag<string> diofilter("diofilter", "");
+
+// Number of tests to run in parallel. 0 means one per core.
+define_flag<int> dio_jobs("dio_jobs", 1);
+
+// Run each test in its own forked child process.
+define_flag<bool> dio_isolate("dio_isolate", false);
+
+// Fail tests that take longer than this. 0 means no limit. Only isolated
+// tests can be stopped; otherwise a test that times out ends the run.
+define_flag<int> dio_timeout_ms("dio_timeout_ms", 0);
+
+// Number of slowest tests to list after the results.
+define_flag<int> dio_slowest("dio_slowest", 5);
+
+// Run only one shard of the tests. Default to the environment variables
+// DIO_SHARD_INDEX and DIO_TOTAL_SHARDS, so a script can shard a whole set of
+// test binaries without knowing about their flags.
+define_flag<int> dio_shard_index("dio_shard_index",
+                                 DioTest::IntFromEnv("DIO_SHARD_INDEX", 0));
+define_flag<int> dio_total_shards("dio_total_shards",
+                                  DioTest::IntFromEnv("DIO_TOTAL_SHARDS", 1));
+
+// Run benchmarks instead of tests: "all", or names and filenames as in
+// diofilter. Defaults to the environment variable DIOBENCH, which also works
+// in binaries built without flags.
+define_flag<string> diobench("diobench", DioTest::StringFromEnv("DIOBENCH",
+                                                                ""));
+
+// Number of timed samples per benchmark, and how long each should take.
+define_flag<int> diobench_samples("diobench_samples", 10);
+define_flag<double> diobench_sample_ms("diobench_sample_ms", 20);
+
+// Also report hardware performance counters per iteration, where the kernel
+// and CPU provide them.
+define_flag<bool> diobench_counters("diobench_counters", true);
+
+// Save benchmark results to this JSON file, e.g., to use as a baseline
+// later.
+define_flag<string> diobench_out("diobench_out",
+                                 DioTest::StringFromEnv("DIOBENCH_OUT", ""));
+
+// Compare benchmark results to those saved in this JSON file, and exit with
+// status 1 if any benchmark got significantly slower by more than
+// diobench_threshold (0.05 means 5%). Significant means a Mann-Whitney
+// p-value below diobench_alpha.
+define_flag<string> diobench_baseline(
+    "diobench_baseline", DioTest::StringFromEnv("DIOBENCH_BASELINE", ""));
+define_flag<double> diobench_threshold("diobench_threshold", 0.05);
+define_flag<double> diobench_alpha("diobench_alpha", 0.01);
 #endif
 
 int main(int argc, char** argv) {
 #if !defined(DONT_INCLUDE_FLAGS)
   eli5::InitializeFlags(argc, argv);
 #endif
+  DioBench::Options bench_options;
+  string bench_out;
+  string bench_baseline;
+  double bench_threshold = 0.05;
+  double bench_alpha = 0.01;
+#if !defined(DONT_INCLUDE_FLAGS)
+  bench_options.run_spec = diobench.get_flag();
+  bench_options.num_samples = diobench_samples.get_flag();
+  bench_options.sample_ms = diobench_sample_ms.get_flag();
+  bench_options.counters = diobench_counters.get_flag();
+  bench_out = diobench_out.get_flag();
+  bench_baseline = diobench_baseline.get_flag();
+  bench_threshold = diobench_threshold.get_flag();
+  bench_alpha = diobench_alpha.get_flag();
+#else
+  bench_options.run_spec = DioTest::StringFromEnv("DIOBENCH", "");
+  bench_out = DioTest::StringFromEnv("DIOBENCH_OUT", "");
+  bench_baseline = DioTest::StringFromEnv("DIOBENCH_BASELINE", "");
+#endif
+  if (!bench_options.run_spec.empty()) {
+    string error = DioTest::Filter(bench_options.run_spec).error();
+    if (!error.empty()) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+    // Load the baseline first, so a bad path doesn't waste a run.
+    std::vector<DioBench::Result> baseline;
+    if (!bench_baseline.empty() &&
+        !DioBench::LoadResults(bench_baseline, &baseline, &error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+    std::vector<DioBench::Result> results = DioBench::RunAll(bench_options);
+    if (!bench_out.empty() &&
+        !DioBench::SaveResults(bench_out, results, &error)) {
+      std::cerr << error << std::endl;
+      return 1;
+    }
+    if (!bench_baseline.empty()) {
+      int num_regressions = DioBench::PrintComparisons(DioBench::Compare(
+          baseline, results, bench_threshold, bench_alpha));
+      return (num_regressions > 0) ? 1 : 0;
+    }
+    return 0;
+  }
+
 #if !defined(DONT_INCLUDE_LOGGING)
   if (!diofilter.get_flag().empty()) {
     LOG(INFO) << "Running a subset of tests: " << diofilter.get_flag();
@@ -21,10 +126,30 @@ int main(int argc, char** argv) {
     LOG(INFO) << "Running all tests.";
   }
 #endif
+  Diogenes::RunOptions options;
 #if !defined(DONT_INCLUDE_FLAGS)
-  Diogenes::RunAll(string(diofilter.get_flag()));
+  options.run_spec = diofilter.get_flag();
+  options.num_jobs = dio_jobs.get_flag();
+  options.isolate = dio_isolate.get_flag();
+  options.timeout_ms = dio_timeout_ms.get_flag();
+  options.num_slowest = dio_slowest.get_flag();
+  options.shard_index = dio_shard_index.get_flag();
+  options.num_shards = dio_total_shards.get_flag();
 #else
-  // No flags. Run all tests.
-  Diogenes::RunAll();
+  // No flags. Run all tests, or the shard given by the environment.
+  options.shard_index = DioTest::IntFromEnv("DIO_SHARD_INDEX", 0);
+  options.num_shards = DioTest::IntFromEnv("DIO_TOTAL_SHARDS", 1);
 #endif
+  if ((options.num_shards < 1) || (options.shard_index < 0) ||
+      (options.shard_index >= options.num_shards)) {
+    std::cerr << "Invalid shard " << options.shard_index << " of "
+              << options.num_shards << std::endl;
+    return 1;
+  }
+  string filter_error = DioTest::Filter(options.run_spec).error();
+  if (!filter_error.empty()) {
+    std::cerr << filter_error << std::endl;
+    return 1;
+  }
+  Diogenes::RunAll(options);
 }
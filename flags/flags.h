@@ -1,5 +1,5 @@
-#ifndef MH62b0b5733fade79610f0881342cc655459250373
-#define MH62b0b5733fade79610f0881342cc655459250373
+#ifndef MH4a42bd649d4cdc9909f517800e622e05a2711b55
+#define MH4a42bd649d4cdc9909f517800e622e05a2711b55
 
 // Eli5 command-line flags module.
 //
@@ -33,8 +33,125 @@
 //
 //     extern define_flag<bool> verbosity("verbosity", 0);
 //
+// Besides the basic types, flags can hold byte sizes, durations and
+// comma-separated lists. They're parsed once, when set, so reading them
+// costs the same as reading an int. E.g.,
+//
+//     define_flag<eli5::ByteSize> cache_size("cache_size", 64 << 20);
+//     define_flag<std::chrono::milliseconds> timeout(
+//         "timeout", std::chrono::milliseconds(250));
+//     define_flag<vector<int>> ports("ports", {80, 443});
+//
+// accept --cache_size=1.5GiB --timeout=2s --ports=8080,8443.
+//
+// To find out which flags are read on hot paths, build with
+// -DELI5_COUNT_FLAG_READS. Every read, through get_flag() or a FlagSnapshot,
+// is then counted, and a report of flags ranked by number of reads is printed
+// to stderr at exit. Flags read millions of times are candidates for being
+// copied into a local variable.
+//
+// get_flag() always returns the flag's latest value. set_flag() changes the
+// value in place, so it's only safe while nothing else reads the flag (e.g.,
+// at startup). Changes made while the program is running (e.g., via
+// FlagsListener) go through PublishFlagFromString, which swaps in a new copy
+// of the value instead, so other threads can keep reading the flag. Code that
+// needs several flags to be consistent with each other reads them through a
+// FlagSnapshot:
+//
+//     eli5::FlagSnapshot flags;
+//     int n = flags.get(num_workers);
+//     double r = flags.get(sampling_ratio);
+//
+// All reads through one snapshot see the same generation of values, even if
+// flags are changed in the meantime, and take no locks.
+//
+// A program that starts worker processes can hand them its flags as a
+// compact binary snapshot, instead of making each one parse argv and
+// flagfiles again. E.g., before fork/exec,
+//
+//     int fd = memfd_create("flags", 0);
+//     eli5::WriteFlagsSnapshot(fd);
+//     lseek(fd, 0, SEEK_SET);
+//
+// and in the worker, before InitializeFlags (so its own argv still wins),
+//
+//     eli5::ReadFlagsSnapshot(fd);
+//
+// The snapshot can also be saved to a file as a record of exactly how a
+// process was configured.
+//
+// Flags can also be read and set while the program is running, over a Unix
+// domain socket. Create a FlagsListener to start serving (see below):
+//
+//     eli5::FlagsListener listener("/tmp/myprogram.flags");
+//
+// and talk to it with any socket client. E.g.,
+//
+//     $ echo "set vlog_level 3" | socat - UNIX-CONNECT:/tmp/myprogram.flags
+//     ok
+//
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+
 namespace eli5 {
 
+#if defined(ELI5_COUNT_FLAG_READS)
+
+// Counts flag reads, for finding flags that are read on hot paths. Each flag
+// counts its own reads in a relaxed atomic (basic_flag::num_reads). That
+// stays usable for as long as the flag exists, even in static destructors,
+// when thread-local counters may already be gone. A flag's count is added to
+// the totals by name when it's destroyed. The report is printed at exit.
+struct FlagReadCounters {
+  // Reads of flags that have been destroyed, by name. Used with the flags
+  // mutex held.
+  static map<string, uint64_t>& get_destroyed_counts() {
+    static map<string, uint64_t> destroyed_counts;
+    return destroyed_counts;
+  }
+
+  // Called by basic_flag when a flag is defined and destroyed.
+  static void RegisterFlag();
+  static void FlagDestroyed(const string& name, uint64_t num_reads);
+
+  // Returns (flag name, number of reads) for all flags with at least one read,
+  // most read first. Flags defined more than once under the same name are
+  // reported once, with their reads added up.
+  static vector<pair<string, uint64_t>> GetRankedCounts();
+
+  static void PrintReport(std::ostream& os) {
+    auto ranked = GetRankedCounts();
+    os << "Flag reads, most read first (ELI5_COUNT_FLAG_READS):" << endl;
+    for (const auto& name_and_count : ranked) {
+      os << "  " << name_and_count.second << "\t" << name_and_count.first
+         << endl;
+    }
+  }
+};
+
+// Prints the report when destroyed at exit.
+struct FlagReadReporter {
+  ~FlagReadReporter() { FlagReadCounters::PrintReport(cerr); }
+};
+#endif
+
 // Base class for all flags: Maintains a (static) registry of all currently
 // defined flags, that is updated from the constructor. Defines a pure virtual
 // method 'set_flag' that parses a string and sets the flag value (this will be
@@ -48,9 +165,41 @@ struct basic_flag {
   // Name of the flag.
   string name;
 
+  // Unique number for the flag, assigned in order of definition. Never reused,
+  // even if the flag is destroyed.
+  int id = -1;
+
+#if defined(ELI5_COUNT_FLAG_READS)
+  // Number of reads so far. See FlagReadCounters.
+  mutable std::atomic<uint64_t> num_reads{0};
+#endif
+
   // Sets the flag by parsing the given string.
   virtual void set_flag_from_string(const string& s) = 0;
 
+  // Sets the flag by parsing the given string, without changing the value
+  // under readers in other threads. See PublishFlagFromString.
+  virtual void publish_flag_from_string(const string& s) = 0;
+
+  // Returns the current value of the flag formatted as a string.
+  virtual string get_flag_as_string() const = 0;
+
+  // Returns the default value of the flag formatted as a string.
+  virtual string get_default_as_string() const = 0;
+
+  // Appends the current value to out, in the form used by flag snapshots. See
+  // SerializeFlags.
+  virtual void append_serialized_value(string* out) const = 0;
+
+  // Decodes bytes written by append_serialized_value into a value of this
+  // flag's type, without changing the flag. Throws std::invalid_argument if
+  // they can't be decoded.
+  virtual shared_ptr<const void> decode_serialized(const char* data,
+                                                   size_t size) const = 0;
+
+  // Sets the flag to a value returned by decode_serialized.
+  virtual void set_flag_from_decoded(const void* decoded) = 0;
+
   // Workaround for C++ verbosity to keep things header-only. Wrap the static
   // registry in a static member function. If we made this a class-level
   // static, we would need a .cc file merely to define the variable.
@@ -59,16 +208,93 @@ struct basic_flag {
     return flags_registry;
   }
 
+  // Serializes all updates to flags and to the registry. Updates can come
+  // from threads other than main (e.g., FlagsListener), so everyone that
+  // changes a flag after startup must hold this lock. See SetFlagFromString.
+  // Recursive, since set_flag takes it too.
+  static std::recursive_mutex& get_flags_mutex() {
+    static std::recursive_mutex flags_mutex;
+    return flags_mutex;
+  }
+
+  static int& get_next_flag_id() {
+    static int next_flag_id = 0;
+    return next_flag_id;
+  }
+
   // Adds this flag to registry of all flags.
   basic_flag(const string& _name) : name(_name) {
+    std::lock_guard<std::recursive_mutex> lock(get_flags_mutex());
+
     // Check that no flag with same name already exists.
     for (const auto& flag : get_flags_registry()) {
       assert(flag->name != name);
     }
 
     get_flags_registry().push_back(this);
+    id = get_next_flag_id()++;
+
+#if defined(ELI5_COUNT_FLAG_READS)
+    FlagReadCounters::RegisterFlag();
+#endif
+  }
+
+  // Removes this flag from the registry, so that flags with a shorter
+  // lifetime than the program (e.g., in tests) don't leave dangling pointers
+  // for FlagsListener to trip over.
+  virtual ~basic_flag() {
+    std::lock_guard<std::recursive_mutex> lock(get_flags_mutex());
+    auto& registry = get_flags_registry();
+    for (auto it = registry.begin(); it != registry.end(); ++it) {
+      if (*it == this) {
+        registry.erase(it);
+        break;
+      }
+    }
+#if defined(ELI5_COUNT_FLAG_READS)
+    FlagReadCounters::FlagDestroyed(name, num_reads.load());
+#endif
   }
 };
+
+#if defined(ELI5_COUNT_FLAG_READS)
+
+inline void FlagReadCounters::RegisterFlag() {
+  // Statics are destroyed in reverse order of construction. Construct the
+  // reporter after everything it uses, so that they're still around when it
+  // runs.
+  basic_flag::get_flags_mutex();
+  basic_flag::get_flags_registry();
+  get_destroyed_counts();
+  static FlagReadReporter reporter;
+};
+inline void FlagReadCounters::FlagDestroyed(const string& name, uint64_t num_reads) {
+  std::lock_guard<std::recursive_mutex> lock(basic_flag::get_flags_mutex());
+  get_destroyed_counts()[name] += num_reads;
+};
+inline vector<pair<string, uint64_t>> FlagReadCounters::GetRankedCounts() {
+  std::lock_guard<std::recursive_mutex> lock(basic_flag::get_flags_mutex());
+  map<string, uint64_t> totals_by_name = get_destroyed_counts();
+  for (const auto* flag : basic_flag::get_flags_registry()) {
+    totals_by_name[flag->name] += flag->num_reads.load();
+  }
+
+  vector<pair<string, uint64_t>> ranked;
+  for (const auto& name_and_count : totals_by_name) {
+    if (name_and_count.second > 0) {
+      ranked.push_back(name_and_count);
+    }
+  }
+  std::sort(ranked.begin(), ranked.end(),
+            [](const pair<string, uint64_t>& a,
+               const pair<string, uint64_t>& b) {
+              return (a.second != b.second) ? (a.second > b.second)
+                                            : (a.first < b.first);
+            });
+  return ranked;
+};
+#endif
+
 template <typename T>
 struct FlagParser {
   T operator()(const string& s) { T::specialization_not_defined(); }
@@ -76,44 +302,565 @@ struct FlagParser {
 template <>
 struct FlagParser<bool> {
   bool operator()(const string& s) {
-    assert((s == "1") || (s == "true") || (s == "0") || (s == "false"));
+    // Throw rather than assert: values can come from FlagsListener, and a typo
+    // there shouldn't take down the process.
+    if ((s != "1") && (s != "true") && (s != "0") && (s != "false")) {
+      throw std::invalid_argument("not a bool: " + s);
+    }
     return (s == "1") || (s == "true");
   }
 };
+
+// Parses numbers with the std::sto* functions. Their errors say no more than
+// the name of the function, so they're replaced with a std::invalid_argument
+// that says what was wrong, e.g., "not an int: many".
+struct NumberParser {
+  template <typename T, typename ParseFunction>
+  static T Parse(const string& s, const string& type_name,
+                 ParseFunction parse) {
+    try {
+      return parse(s);
+    } catch (const std::out_of_range&) {
+      throw std::invalid_argument("out of range for " + type_name + ": " + s);
+    } catch (const std::invalid_argument&) {
+      throw std::invalid_argument("not " + type_name + ": " + s);
+    }
+  }
+};
 template <>
 struct FlagParser<int> {
-  int operator()(const string& s) { return std::stoi(s); }
+  int operator()(const string& s) {
+    return NumberParser::Parse<int>(
+        s, "an int", [](const string& s) { return std::stoi(s); });
+  }
 };
 template <>
 struct FlagParser<float> {
-  int operator()(const string& s) { return std::stof(s); }
+  float operator()(const string& s) {
+    return NumberParser::Parse<float>(
+        s, "a float", [](const string& s) { return std::stof(s); });
+  }
 };
 template <>
 struct FlagParser<double> {
-  int operator()(const string& s) { return std::stod(s); }
+  double operator()(const string& s) {
+    return NumberParser::Parse<double>(
+        s, "a double", [](const string& s) { return std::stod(s); });
+  }
 };
 template <>
 struct FlagParser<string> {
   string operator()(const string& s) { return s; }
 };
-template <typename ValueType, typename FlagParserType = FlagParser<ValueType>>
+
+// Inverse of FlagParser: formats a flag value as a string. Used to report
+// flag values (e.g., by FlagsListener). The default works for anything that
+// can be written to an ostream.
+template <typename T>
+struct FlagFormatter {
+  string operator()(const T& v) {
+    std::ostringstream os;
+    os << v;
+    return os.str();
+  }
+};
+template <>
+struct FlagFormatter<bool> {
+  string operator()(const bool& v) { return v ? "true" : "false"; }
+};
+template <>
+struct FlagFormatter<string> {
+  string operator()(const string& v) { return v; }
+};
+
+// Splits a string like "64MiB" or "250ms" into its number and unit parts.
+// Throws std::invalid_argument if it doesn't start with a number.
+inline pair<double, string> SplitNumberAndUnit(const string& s) {
+  size_t unit_pos = 0;
+  double number = NumberParser::Parse<double>(
+      s, "a number",
+      [&unit_pos](const string& s) { return std::stod(s, &unit_pos); });
+  return make_pair(number, s.substr(unit_pos));
+};
+
+// A number of bytes. Use define_flag<ByteSize> for flags like cache sizes, so
+// that they can be set as "64MiB" or "1.5GB" instead of counting zeros.
+struct ByteSize {
+  uint64_t bytes = 0;
+
+  ByteSize() {}
+  ByteSize(uint64_t _bytes) : bytes(_bytes) {}
+
+  operator uint64_t() const { return bytes; }
+};
+
+// Units are B, KB, MB, GB, TB (powers of 1000) and KiB, MiB, GiB, TiB (powers
+// of 1024). No unit means bytes.
+template <>
+struct FlagParser<ByteSize> {
+  ByteSize operator()(const string& s) {
+    static const pair<const char*, uint64_t> units[] = {
+        {"", 1},
+        {"B", 1},
+        {"KB", 1000},
+        {"MB", 1000 * 1000},
+        {"GB", 1000 * 1000 * 1000},
+        {"TB", 1000ull * 1000 * 1000 * 1000},
+        {"KiB", 1ull << 10},
+        {"MiB", 1ull << 20},
+        {"GiB", 1ull << 30},
+        {"TiB", 1ull << 40}};
+    auto number_and_unit = SplitNumberAndUnit(s);
+    if (number_and_unit.first < 0) {
+      throw std::invalid_argument("negative byte size: " + s);
+    }
+    for (const auto& unit : units) {
+      if (number_and_unit.second == unit.first) {
+        double bytes = number_and_unit.first * unit.second;
+        // INT64_MAX rounds up to 2^63 as a double, so anything not below it
+        // (or NaN) would overflow llround.
+        if (!(bytes < static_cast<double>(INT64_MAX))) {
+          throw std::invalid_argument("byte size out of range: " + s);
+        }
+        return ByteSize(std::llround(bytes));
+      }
+    }
+    throw std::invalid_argument("unknown byte size unit: " + s);
+  }
+};
+
+// Uses the largest binary unit that represents the size exactly.
+template <>
+struct FlagFormatter<ByteSize> {
+  string operator()(const ByteSize& v) {
+    static const pair<const char*, uint64_t> units[] = {
+        {"TiB", 1ull << 40}, {"GiB", 1ull << 30}, {"MiB", 1ull << 20},
+        {"KiB", 1ull << 10}};
+    for (const auto& unit : units) {
+      if ((v.bytes != 0) && (v.bytes % unit.second == 0)) {
+        return to_string(v.bytes / unit.second) + unit.first;
+      }
+    }
+    return to_string(v.bytes) + "B";
+  }
+};
+
+// Returns the length of a duration unit (h, m, s, ms, us, ns) in nanoseconds.
+// Throws std::invalid_argument for anything else.
+inline double DurationUnitInNanoseconds(const string& unit) {
+  static const pair<const char*, double> units[] = {
+      {"h", 3600e9}, {"m", 60e9}, {"s", 1e9},
+      {"ms", 1e6},   {"us", 1e3}, {"ns", 1}};
+  for (const auto& u : units) {
+    if (unit == u.first) {
+      return u.second;
+    }
+  }
+  throw std::invalid_argument("unknown duration unit: '" + unit + "'");
+};
+
+// Durations like "250ms", "1.5s" or "2h" for any std::chrono::duration.
+// A unit is required, except for "0".
+template <typename Rep, typename Period>
+struct FlagParser<std::chrono::duration<Rep, Period>> {
+  std::chrono::duration<Rep, Period> operator()(const string& s) {
+    auto number_and_unit = SplitNumberAndUnit(s);
+    double ns = number_and_unit.first;
+    if (!((ns == 0) && number_and_unit.second.empty())) {
+      ns *= DurationUnitInNanoseconds(number_and_unit.second);
+    }
+    std::chrono::duration<double, Period> d =
+        std::chrono::duration<double, std::nano>(ns);
+    // As for ByteSize, the largest Rep may round up as a double, so the
+    // count has to be below it. NaN fails both comparisons.
+    double count = d.count();
+    double min = static_cast<double>(std::numeric_limits<Rep>::lowest());
+    double max = static_cast<double>(std::numeric_limits<Rep>::max());
+    bool in_range = std::is_floating_point<Rep>::value
+                        ? std::isfinite(count)
+                        : (count >= min) && (count < max);
+    if (!in_range) {
+      throw std::invalid_argument("duration out of range: " + s);
+    }
+    return std::chrono::duration<Rep, Period>(static_cast<Rep>(
+        std::is_floating_point<Rep>::value ? count : std::llround(count)));
+  }
+};
+
+// Uses the largest unit that represents the duration exactly (at nanosecond
+// resolution).
+template <typename Rep, typename Period>
+struct FlagFormatter<std::chrono::duration<Rep, Period>> {
+  string operator()(const std::chrono::duration<Rep, Period> &v) {
+    static const pair<const char*, int64_t> units[] = {
+        {"h", 3600000000000ll}, {"m", 60000000000ll}, {"s", 1000000000},
+        {"ms", 1000000},        {"us", 1000}};
+    int64_t ns =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(v).count();
+    for (const auto& unit : units) {
+      if ((ns != 0) && (ns % unit.second == 0)) {
+        return to_string(ns / unit.second) + unit.first;
+      }
+    }
+    return to_string(ns) + ((ns == 0) ? "s" : "ns");
+  }
+};
+
+// Comma-separated lists, e.g., --ports=80,443 for define_flag<vector<int>>.
+// Each element is parsed by the element type's FlagParser, once, when the flag
+// is set. So the flag hands out a ready-to-use vector.
+template <typename T>
+struct FlagParser<vector<T>> {
+  vector<T> operator()(const string& s) {
+    vector<T> values;
+    if (s.empty()) {
+      return values;
+    }
+    FlagParser<T> element_parser{};
+    size_t start = 0;
+    while (true) {
+      size_t comma_pos = s.find(',', start);
+      values.push_back(element_parser(s.substr(start, comma_pos - start)));
+      if (comma_pos == string::npos) {
+        break;
+      }
+      start = comma_pos + 1;
+    }
+    return values;
+  }
+};
+template <typename T>
+struct FlagFormatter<vector<T>> {
+  string operator()(const vector<T> &v) {
+    FlagFormatter<T> element_formatter{};
+    string out;
+    for (size_t i = 0; i < v.size(); ++i) {
+      if (i > 0) {
+        out += ',';
+      }
+      out += element_formatter(v[i]);
+    }
+    return out;
+  }
+};
+
+// Converts flag values to and from the bytes stored in flag snapshots (see
+// SerializeFlags). Trivially copyable types (numbers, ByteSize, durations)
+// are stored as their raw bytes, strings and vectors as their contents.
+// Anything else falls back to the type's FlagFormatter and FlagParser.
+//
+// Snapshots are meant to be read by the same binary on the same machine, so
+// the raw bytes are in native byte order.
+template <typename T, bool is_raw = std::is_trivially_copyable<T>::value>
+struct FlagSerializer {
+  void Write(const T& v, string* out) {
+    out->append(FlagFormatter<T>{}(v));
+  }
+
+  T Read(const char* data, size_t size) {
+    return FlagParser<T>{}(string(data, size));
+  }
+};
+template <typename T>
+struct FlagSerializer<T, true> {
+  void Write(const T& v, string* out) {
+    out->append(reinterpret_cast<const char*>(&v), sizeof(v));
+  }
+
+  T Read(const char* data, size_t size) {
+    if (size != sizeof(T)) {
+      throw std::invalid_argument("flag snapshot value has wrong size");
+    }
+    T v;
+    memcpy(&v, data, sizeof(T));
+    return v;
+  }
+};
+template <>
+struct FlagSerializer<string> {
+  void Write(const string& v, string* out) { out->append(v); }
+
+  string Read(const char* data, size_t size) { return string(data, size); }
+};
+
+// Vectors of trivially copyable types are stored as one contiguous block.
+// Other vectors (including vector<bool>, which isn't contiguous) are stored as
+// a sequence of length-prefixed elements.
+template <typename T>
+struct FlagSerializer<vector<T>, false> {
+  typedef std::integral_constant<bool, std::is_trivially_copyable<T>::value &&
+                                           !std::is_same<T, bool>::value>
+      is_block;
+
+  void Write(const vector<T> &v, string* out) { Write(v, out, is_block()); }
+
+  vector<T> Read(const char* data, size_t size) {
+    return Read(data, size, is_block());
+  }
+
+  void Write(const vector<T> &v, string* out, std::true_type) {
+    out->append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+  }
+
+  vector<T> Read(const char* data, size_t size, std::true_type) {
+    if (size % sizeof(T) != 0) {
+      throw std::invalid_argument("flag snapshot value has wrong size");
+    }
+    vector<T> v(size / sizeof(T));
+    memcpy(v.data(), data, size);
+    return v;
+  }
+
+  void Write(const vector<T> &v, string* out, std::false_type) {
+    string element;
+    for (size_t i = 0; i < v.size(); ++i) {
+      element.clear();
+      FlagSerializer<T>{}.Write(v[i], &element);
+      uint32_t element_size = element.size();
+      out->append(reinterpret_cast<const char*>(&element_size),
+                  sizeof(element_size));
+      out->append(element);
+    }
+  }
+
+  vector<T> Read(const char* data, size_t size, std::false_type) {
+    vector<T> v;
+    size_t pos = 0;
+    while (pos < size) {
+      uint32_t element_size;
+      if (size - pos < sizeof(element_size)) {
+        throw std::invalid_argument("truncated flag snapshot value");
+      }
+      memcpy(&element_size, data + pos, sizeof(element_size));
+      pos += sizeof(element_size);
+      if (size - pos < element_size) {
+        throw std::invalid_argument("truncated flag snapshot value");
+      }
+      v.push_back(FlagSerializer<T>{}.Read(data + pos, element_size));
+      pos += element_size;
+    }
+    return v;
+  }
+};
+
+// An immutable copy of the values of all flags. A new generation is made
+// every time a flag changes, or once for flags changed together (see
+// FlagGenerations::Batch). Values are indexed by flag id. Flags that were
+// never set have no value (the vector is too short, or holds nullptr), and
+// readers use their default. That way defining a flag doesn't need a new
+// generation. See FlagSnapshot.
+struct FlagGeneration {
+  uint64_t number = 0;
+  vector<shared_ptr<const void>> values;
+
+  // Returns the value of the flag with flag_id, or nullptr if it has none.
+  const void* Get(int flag_id) const {
+    return (flag_id < values.size()) ? values[flag_id].get() : nullptr;
+  }
+};
+
+// Keeps track of flag generations for FlagSnapshot. Writers publish a new
+// generation while holding the flags mutex. Readers pin the current
+// generation without locking: a pin is a per-thread pointer (a hazard
+// pointer) that writers check before freeing a replaced generation. Replaced
+// generations are freed as soon as no reader has them pinned.
+struct FlagGenerations {
+  // A thread's pin. Registered with the list of pins on first use in each
+  // thread, so that's the only time a reader takes a lock.
+  struct ReaderPin {
+    std::atomic<const FlagGeneration*> pinned{nullptr};
+
+    // Number of live snapshots in this thread. Nested snapshots share the
+    // outermost one's generation.
+    int depth = 0;
+
+    ReaderPin() {
+      std::lock_guard<std::recursive_mutex> lock(basic_flag::get_flags_mutex());
+      get_pins().push_back(this);
+    }
+
+    ~ReaderPin() {
+      std::lock_guard<std::recursive_mutex> lock(basic_flag::get_flags_mutex());
+      auto& pins = get_pins();
+      pins.erase(std::find(pins.begin(), pins.end(), this));
+    }
+  };
+
+  static ReaderPin& PinForThisThread() {
+    thread_local ReaderPin pin;
+    return pin;
+  }
+
+  // Deliberately never freed, so that flags changed during static destruction
+  // don't find it gone.
+  static std::atomic<const FlagGeneration*>& get_current() {
+    static auto* current =
+        new std::atomic<const FlagGeneration*>(new FlagGeneration());
+    return* current;
+  }
+
+  // The rest are only used with the flags mutex held.
+  static vector<ReaderPin*>& get_pins() {
+    static auto* pins = new vector<ReaderPin*>();
+    return* pins;
+  }
+
+  // Replaced generations that may still be pinned.
+  static vector<const FlagGeneration*>& get_retired() {
+    static auto* retired = new vector<const FlagGeneration*>();
+    return* retired;
+  }
+
+  // The generation being built by an open Batch, or nullptr.
+  static FlagGeneration*& get_pending() {
+    static FlagGeneration* pending = nullptr;
+    return pending;
+  }
+
+  static int& get_batch_depth() {
+    static int batch_depth = 0;
+    return batch_depth;
+  }
+
+  // Gathers everything published while it's alive into one new generation,
+  // made current when the outermost batch ends. Each generation copies the
+  // values of all flags, so setting many flags at once (e.g., at startup)
+  // should be done in a batch. Holds the flags mutex.
+  struct Batch {
+    std::lock_guard<std::recursive_mutex> lock;
+
+    Batch() : lock(basic_flag::get_flags_mutex()) { ++get_batch_depth(); }
+
+    ~Batch() {
+      if (--get_batch_depth() == 0) {
+        MakePendingCurrent();
+      }
+    }
+  };
+
+  // Sets value for flag_id in a new generation that is otherwise the same as
+  // the current one, and makes it current (or, in a Batch, leaves that to the
+  // end of the batch).
+  static void Publish(int flag_id, shared_ptr<const void> value) {
+    std::lock_guard<std::recursive_mutex> lock(basic_flag::get_flags_mutex());
+    FlagGeneration*& pending = get_pending();
+    if (pending == nullptr) {
+      const FlagGeneration* old_generation = get_current().load();
+      pending = new FlagGeneration(*old_generation);
+      pending->number = old_generation->number + 1;
+    }
+    if (pending->values.size() <= flag_id) {
+      pending->values.resize(flag_id + 1);
+    }
+    pending->values[flag_id] = move(value);
+    if (get_batch_depth() == 0) {
+      MakePendingCurrent();
+    }
+  }
+
+  static void MakePendingCurrent() {
+    FlagGeneration*& pending = get_pending();
+    if (pending == nullptr) {
+      return;
+    }
+    get_retired().push_back(get_current().load());
+    get_current().store(pending);
+    pending = nullptr;
+    FreeUnpinned();
+  }
+
+  static void FreeUnpinned() {
+    auto& retired = get_retired();
+    for (auto it = retired.begin(); it != retired.end();) {
+      bool is_pinned = false;
+      for (const auto* pin : get_pins()) {
+        is_pinned = is_pinned || (pin->pinned.load() == *it);
+      }
+      if (is_pinned) {
+        ++it;
+      } else {
+        delete* it;
+        it = retired.erase(it);
+      }
+    }
+  }
+};
+template <typename ValueType, typename FlagParserType = FlagParser<ValueType>,
+          typename FlagFormatterType = FlagFormatter<ValueType>>
 struct define_flag : basic_flag {
   ValueType value;
+  const ValueType default_value;
+
+  // Where get_flag() reads the value from: value, until the flag is first set
+  // with publish_flag. That stores each new value in published_values and
+  // points current at it, rather than changing a value other threads may be
+  // reading. Replaced values are kept until the flag is destroyed, since
+  // readers may still hold references to them.
+  std::atomic<ValueType*> current;
+  vector<unique_ptr<ValueType>> published_values;
 
   define_flag(const string& _name, const ValueType& _default_value)
-      : basic_flag(_name), value(_default_value){};
+      : basic_flag(_name), value(_default_value),
+        default_value(_default_value), current(&value) {}
 
   const ValueType& set_flag(const ValueType& new_value) {
-    value = new_value;
-    return get_flag();
+    std::lock_guard<std::recursive_mutex> lock(get_flags_mutex());
+    ValueType* v = current.load();
+    *v = new_value;
+    FlagGenerations::Publish(id, std::make_shared<const ValueType>(*v));
+    return* v;
+  }
+
+  // Like set_flag, but safe while other threads read the flag. Each call
+  // keeps one more value alive, so it's meant for occasional changes.
+  void publish_flag(const ValueType& new_value) {
+    std::lock_guard<std::recursive_mutex> lock(get_flags_mutex());
+    published_values.emplace_back(new ValueType(new_value));
+    current.store(published_values.back().get(), std::memory_order_release);
+    FlagGenerations::Publish(id, std::make_shared<const ValueType>(new_value));
   }
 
   void set_flag_from_string(const string& s) override {
     FlagParserType parser{};
-    set_flag(static_cast<const ValueType&>(parser(s)));
+    set_flag(static_cast<const ValueType &>(parser(s)));
+  }
+
+  void publish_flag_from_string(const string& s) override {
+    FlagParserType parser{};
+    publish_flag(static_cast<const ValueType &>(parser(s)));
+  }
+
+  string get_flag_as_string() const override {
+    FlagFormatterType formatter{};
+    return formatter(*current.load(std::memory_order_acquire));
+  }
+
+  string get_default_as_string() const override {
+    FlagFormatterType formatter{};
+    return formatter(default_value);
+  }
+
+  void append_serialized_value(string* out) const override {
+    FlagSerializer<ValueType>{}.Write(*current.load(std::memory_order_acquire),
+                                      out);
+  }
+
+  shared_ptr<const void> decode_serialized(const char* data,
+                                           size_t size) const override {
+    return std::make_shared<const ValueType>(
+        FlagSerializer<ValueType>{}.Read(data, size));
   }
 
-  const ValueType& get_flag() const { return value; }
+  void set_flag_from_decoded(const void* decoded) override {
+    set_flag(*static_cast<const ValueType*>(decoded));
+  }
+
+  const ValueType& get_flag() const {
+#if defined(ELI5_COUNT_FLAG_READS)
+    num_reads.fetch_add(1, std::memory_order_relaxed);
+#endif
+    return* current.load(std::memory_order_acquire);
+  }
 
   // Syntax sugar around get_flag. Can directly access the flag
   // as a const reference.
@@ -125,8 +872,106 @@ struct define_flag : basic_flag {
   }
 };
 
+// A consistent view of all flags, for code that runs while flags may be
+// changing. E.g., take one at the start of handling a request and read all
+// flags through it: they'll all come from the same generation, no matter what
+// changes meanwhile.
+//
+// Taking a snapshot pins the current generation of flag values, so that it
+// isn't freed while in use. That costs a couple of atomic operations and no
+// locks (except the first time in each thread). Reading a flag through a
+// snapshot is an array lookup.
+//
+// A snapshot belongs to the thread that took it, and must not be passed to
+// other threads. Snapshots taken while another one is alive in the same
+// thread see the same generation as the outer one.
+struct FlagSnapshot {
+  FlagGenerations::ReaderPin& pin;
+  const FlagGeneration* generation = nullptr;
+
+  FlagSnapshot() : pin(FlagGenerations::PinForThisThread()) {
+    if (pin.depth++ > 0) {
+      generation = pin.pinned.load();
+      return;
+    }
+    // Once the pin is set, the generation can't be freed. But it could have
+    // been replaced (and freed) between the load and the pin. So check that
+    // it's still current after pinning, and try again if not.
+    auto& current = FlagGenerations::get_current();
+    do {
+      generation = current.load();
+      pin.pinned.store(generation);
+    } while (generation != current.load());
+  }
+
+  ~FlagSnapshot() {
+    if (--pin.depth == 0) {
+      // Release is enough: a writer that still sees the old pin only frees
+      // the generation later than it could have.
+      pin.pinned.store(nullptr, std::memory_order_release);
+    }
+  }
+
+  FlagSnapshot(const FlagSnapshot&) = delete;
+  FlagSnapshot& operator=(const FlagSnapshot&) = delete;
+
+  // Increases every time any flag changes (by one for a whole Batch).
+  uint64_t generation_number() const { return generation->number; }
+
+  // Returns the value of flag in this snapshot's generation.
+  template <typename ValueType, typename FlagParserType,
+            typename FlagFormatterType>
+  const ValueType& get(
+      const define_flag<ValueType, FlagParserType, FlagFormatterType>& flag)
+      const {
+#if defined(ELI5_COUNT_FLAG_READS)
+    flag.num_reads.fetch_add(1, std::memory_order_relaxed);
+#endif
+    const void* value = generation->Get(flag.id);
+    if (value == nullptr) {
+      // Flag wasn't set before this snapshot was taken.
+      return flag.default_value;
+    }
+    return* static_cast<const ValueType*>(value);
+  }
+};
+
+// Sets the flag with the given name by parsing value. Serialized with all
+// other updates, but it changes the value in place, so it's only safe while
+// no other thread reads the flag (e.g., at startup). Use PublishFlagFromString
+// otherwise. Returns false if there's no such flag. Throws if the value can't
+// be parsed (e.g., std::invalid_argument).
+inline bool SetFlagFromString(const string& name, const string& value) {
+  std::lock_guard<std::recursive_mutex> lock(basic_flag::get_flags_mutex());
+  for (auto* flag : basic_flag::get_flags_registry()) {
+    if (name == flag->name) {
+      flag->set_flag_from_string(value);
+      return true;
+    }
+  }
+  return false;
+};
+
+// Like SetFlagFromString, but safe while other threads read the flag: the new
+// value is stored in a new copy, which get_flag() then returns, rather than
+// overwriting the old one under its readers. The old copy is kept until the
+// flag is destroyed, so this is for occasional changes (e.g., FlagsListener),
+// not for changing a flag in a loop. Returns false if there's no such flag.
+// Throws if the value can't be parsed.
+inline bool PublishFlagFromString(const string& name, const string& value) {
+  std::lock_guard<std::recursive_mutex> lock(basic_flag::get_flags_mutex());
+  for (auto* flag : basic_flag::get_flags_registry()) {
+    if (name == flag->name) {
+      flag->publish_flag_from_string(value);
+      return true;
+    }
+  }
+  return false;
+};
+
 // Call this at the start of main.
 inline void InitializeFlags(int argc, char** argv) {
+  FlagGenerations::Batch batch;
   for (int i = 1; i < argc; ++i) {
     string cmdparam(argv[i]);
 
@@ -161,13 +1006,307 @@ inline void InitializeFlags(int argc, char** argv) {
 
     // Extract the flag name and value parts from the command-line parameter.
     string flag_name = cmdparam.substr(2, split_pos - 2);
-    string flag_value = cmdparam.substr(split_pos + 1);
+    string flag_value = cmdparam.substr(split_pos+1);
+
+    SetFlagFromString(flag_name, flag_value);
+  }
+};
+
+// Returns the values of all flags as a compact binary blob. Applying it with
+// ApplySerializedFlags, e.g., in a child process, restores the same values
+// without any parsing of strings. The format is:
+//
+//   "ELI5FLG" <version byte> <uint32 number of flags>
+//   then, for each flag: <uint32 size> <name> <uint32 size> <value>
+//
+// with values encoded by FlagSerializer.
+inline string SerializeFlags() {
+  string blob("ELI5FLG\x01", 8);
+  auto append_uint32 = [&blob](uint32_t n) {
+    blob.append(reinterpret_cast<const char*>(&n), sizeof(n));
+  };
+
+  std::lock_guard<std::recursive_mutex> lock(basic_flag::get_flags_mutex());
+  append_uint32(basic_flag::get_flags_registry().size());
+  string value;
+  for (const auto* flag : basic_flag::get_flags_registry()) {
+    value.clear();
+    flag->append_serialized_value(&value);
+    append_uint32(flag->name.size());
+    blob.append(flag->name);
+    append_uint32(value.size());
+    blob.append(value);
+  }
+  return blob;
+};
+
+// Sets flags from a blob made by SerializeFlags. Flags in the blob that this
+// program doesn't define are ignored. Returns false, without changing any
+// flag, if the blob is malformed or a value can't be decoded (e.g., the
+// flag's type differs from the blob's).
+inline bool ApplySerializedFlags(const char* data, size_t size) {
+  // Pairs of (name, value) pointing into data.
+  vector<pair<pair<const char*, uint32_t>, pair<const char*, uint32_t>>> flags;
+  size_t pos = 8;
+  auto read_uint32 = [&](uint32_t* n) {
+    if (size - pos < sizeof(*n)) {
+      return false;
+    }
+    memcpy(n, data + pos, sizeof(*n));
+    pos += sizeof(*n);
+    return true;
+  };
+  auto read_bytes = [&](pair<const char*, uint32_t>* bytes) {
+    if (!read_uint32(&bytes->second) || (size - pos < bytes->second)) {
+      return false;
+    }
+    bytes->first = data + pos;
+    pos += bytes->second;
+    return true;
+  };
+
+  uint32_t num_flags = 0;
+  if ((size < pos) || (memcmp(data, "ELI5FLG\x01", pos) != 0) ||
+      !read_uint32(&num_flags)) { return false; }
+  for (uint32_t i = 0; i < num_flags; ++i) {
+    pair<const char*, uint32_t> name, value;
+    if (!read_bytes(&name) || !read_bytes(&value)) {
+      return false;
+    }
+    flags.push_back(make_pair(name, value));
+  }
+  if (pos != size) {
+    return false;
+  }
+
+  // Decode every value before changing any flag, so that a bad one doesn't
+  // leave the flags half applied.
+  std::lock_guard<std::recursive_mutex> lock(basic_flag::get_flags_mutex());
+  vector<pair<basic_flag*, shared_ptr<const void>>> decoded;
+  try {
+    for (const auto& name_and_value : flags) {
+      string name(name_and_value.first.first, name_and_value.first.second);
+      for (auto* flag : basic_flag::get_flags_registry()) {
+        if (flag->name == name) {
+          decoded.push_back(make_pair(
+              flag, flag->decode_serialized(name_and_value.second.first,
+                                            name_and_value.second.second)));
+        }
+      }
+    }
+  } catch (const std::invalid_argument&) {
+    return false;
+  }
+  FlagGenerations::Batch batch;
+  for (const auto& flag_and_value : decoded) {
+    flag_and_value.first->set_flag_from_decoded(flag_and_value.second.get());
+  }
+  return true;
+};
+inline bool ApplySerializedFlags(const string& blob) {
+  return ApplySerializedFlags(blob.data(), blob.size());
+};
+
+// Writes SerializeFlags() to fd, e.g., a pipe, a file or a memfd shared with
+// child processes. Returns false on error.
+inline bool WriteFlagsSnapshot(int fd) {
+  string blob = SerializeFlags();
+  size_t written = 0;
+  while (written < blob.size()) {
+    ssize_t n = write(fd, blob.data() + written, blob.size() - written);
+    if ((n < 0) && (errno == EINTR)) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    written += n;
+  }
+  return true;
+};
+
+// Reads a snapshot written by WriteFlagsSnapshot from fd and applies it.
+// Reads from the current offset until end of file, so a snapshot can follow
+// other data in a file. That means that whoever wrote a file or memfd must
+// rewind it (or seek to where the snapshot starts) before it's read. Returns
+// false on error.
+inline bool ReadFlagsSnapshot(int fd) {
+  string blob;
+  char buf[4096];
+  ssize_t n;
+  while (((n = read(fd, buf, sizeof(buf))) > 0) ||
+         ((n < 0) && (errno == EINTR))) {
+    if (n > 0) {
+      blob.append(buf, n);
+    }
+  }
+  return (n == 0) && ApplySerializedFlags(blob);
+};
+
+// Serves the flags registry over a Unix domain socket, so that flags can be
+// inspected and changed in a running program. E.g., to turn up vlog_level on
+// one misbehaving process without restarting it.
+//
+// Serving happens on a background thread owned by the listener. Updates go
+// through PublishFlagFromString, so they're serialized with all other updates
+// and safe while other threads read the flags. The listener stops, and
+// removes the socket file, when destroyed.
+//
+// The protocol is line-oriented text. Each command gets back zero or more
+// lines of output followed by a line that is either "ok" or "error: ...".
+//
+//   list                 One line per flag: name<TAB>value<TAB>default.
+//   get <name>           Same as list, for a single flag.
+//   set <name> <value>   Sets the flag. Value is the rest of the line.
+//
+// Clients are served one at a time. There's no authentication: access is
+// controlled by the file permissions on the socket.
+struct FlagsListener {
+  string socket_path;
+  int listen_fd = -1;
+  std::atomic<bool> stop_requested{false};
+  std::thread server_thread;
+
+  // Starts listening on socket_path, replacing any stale socket file there.
+  // Check is_listening() to see if it worked.
+  FlagsListener(const string& _socket_path) : socket_path(_socket_path) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.empty() || (socket_path.size() >= sizeof(addr.sun_path))) {
+      return;
+    }
+    strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return;
+    }
+    unlink(socket_path.c_str());
+    if ((bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) ||
+        (listen(fd, 4) != 0)) {
+      close(fd);
+      return;
+    }
+    listen_fd = fd;
+    server_thread = std::thread([this]() { Serve(); });
+  }
+
+  ~FlagsListener() {
+    stop_requested = true;
+    if (server_thread.joinable()) {
+      server_thread.join();
+    }
+    if (listen_fd >= 0) {
+      close(listen_fd);
+      unlink(socket_path.c_str());
+    }
+  }
+
+  bool is_listening() const { return listen_fd >= 0; }
+
+  // Waits until fd is readable. Wakes up periodically to check whether we've
+  // been asked to stop. Returns false if we should stop.
+  bool WaitForInput(int fd) {
+    while (!stop_requested) {
+      pollfd pfd{fd, POLLIN, 0};
+      if (poll(&pfd, 1, 100 /* ms */) > 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Accept loop. Runs on server_thread.
+  void Serve() {
+    while (WaitForInput(listen_fd)) {
+      int client_fd = accept(listen_fd, nullptr, nullptr);
+      if (client_fd >= 0) {
+        ServeClient(client_fd);
+        close(client_fd);
+      }
+    }
+  }
+
+  // Runs commands from one client until it hangs up.
+  void ServeClient(int client_fd) {
+    string pending;
+    char buf[512];
+    while (WaitForInput(client_fd)) {
+      ssize_t n = read(client_fd, buf, sizeof(buf));
+      if (n <= 0) {
+        return;
+      }
+      pending.append(buf, n);
+
+      size_t newline_pos;
+      while ((newline_pos = pending.find('\n')) != string::npos) {
+        string response = RunCommand(pending.substr(0, newline_pos));
+        pending.erase(0, newline_pos + 1);
+        if (!WriteAll(client_fd, response)) {
+          return;
+        }
+      }
+    }
+  }
+
+  static bool WriteAll(int fd, const string& s) {
+    size_t written = 0;
+    while (written < s.size()) {
+      ssize_t n =
+          send(fd, s.data() + written, s.size() - written, MSG_NOSIGNAL);
+      if (n <= 0) {
+        return false;
+      }
+      written += n;
+    }
+    return true;
+  }
+
+  // Executes a single command line and returns the response to send back.
+  static string RunCommand(string line) {
+    if (!line.empty() && (line.back() == '\r')) {
+      line.pop_back();
+    }
+    auto space_pos = line.find(' ');
+    string command = line.substr(0, space_pos);
+    string args = (space_pos == string::npos) ? "" : line.substr(space_pos + 1);
+
+    if (command == "list") {
+      return ListFlags("") + "ok\n";
+    } else if (command == "get") {
+      string listing = ListFlags(args);
+      return listing.empty() ? ("error: no such flag: " + args + "\n")
+                             : (listing + "ok\n");
+    } else if (command == "set") {
+      space_pos = args.find(' ');
+      if (space_pos == string::npos) {
+        return "error: usage: set <name> <value>\n";
+      }
+      string flag_name = args.substr(0, space_pos);
+      try {
+        if (!PublishFlagFromString(flag_name, args.substr(space_pos + 1))) {
+          return "error: no such flag: " + flag_name + "\n";
+        }
+      } catch (const std::exception& e) {
+        return string("error: bad value: ") + e.what() + "\n";
+      }
+      return "ok\n";
+    }
+    return "error: unknown command: " + command + "\n";
+  }
 
-    for (auto* flag : basic_flag::get_flags_registry()) {
-      if (flag_name == flag->name) {
-        flag->set_flag_from_string(flag_value);
+  // Formats the named flag, or all flags if only_name is empty.
+  static string ListFlags(const string& only_name) {
+    std::lock_guard<std::recursive_mutex> lock(basic_flag::get_flags_mutex());
+    string out;
+    for (const auto* flag : basic_flag::get_flags_registry()) {
+      if (only_name.empty() || (only_name == flag->name)) {
+        out += flag->name + "\t" + flag->get_flag_as_string() + "\t" +
+               flag->get_default_as_string() + "\n";
       }
     }
+    return out;
   }
 };
 }
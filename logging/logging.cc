@@ -147,3 +147,53 @@ static DioTest Test_Vlog = []() {
   MLOG(1) << "Hello vlog11.";
   vlog_level.set_flag(prev_level);
 };
+
+// Changes published while the program runs (e.g., by a FlagsListener) apply to
+// log statements that start after them.
+static DioTest Test_VlogSeesPublishedLevel = []() {
+  int prev_level = vlog_level.get_flag();
+  InMemoryLogger(1);  // Clear log.
+  eli5::PublishFlagFromString("vlog_level", "5");
+  MLOG(5) << "Hello vlog5.";
+  vlog_level.set_flag(prev_level);
+  MLOG(5) << "Hello again vlog5.";
+  const string log = InMemoryLogger()->str();
+  DioExpect(log.find("Hello vlog5.") != string::npos);
+  DioExpect(log.find("Hello again vlog5.") == string::npos);
+  DioExpect(vlog_level.get_flag() == prev_level);
+};
+
+// Logging below the vlog level must be cheap enough to leave in hot paths,
+// so it must not allocate.
+static DioTest Test_MlogBelowLevelDoesNotAllocate = []() {
+  InMemoryLogger(1);  // Clear log.
+  DioResetAllocations();
+  for (int i = 0; i < 100; ++i) {
+    MLOG(100) << "Not logged " << i;
+  }
+  DioExpectAllocationsAtMost(0);
+};
+
+namespace {
+
+// Benchmarks. Run with: ./logging_test_main --diobench=logging.cc
+
+DIOBENCH(BM_LogToMemory) = [](DioBenchState& s) {
+  int i = 0;
+  while (s.KeepRunning()) {
+    LOG(MEMORY) << "Hello world " << i;
+    if (++i % 4096 == 0) {
+      InMemoryLogger(1);  // Keep the log from growing without bound.
+    }
+  }
+  InMemoryLogger(1);
+};
+
+// Logging below the vlog level skips formatting the streamed values.
+DIOBENCH(BM_MlogBelowLevel) = [](DioBenchState& s) {
+  while (s.KeepRunning()) {
+    MLOG(100) << "Not logged " << 42;
+  }
+};
+
+}
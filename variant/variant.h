@@ -1,7 +1,24 @@
-#ifndef MH7b0f24379ba7c65ff685f5178ea87242249b1395
-#define MH7b0f24379ba7c65ff685f5178ea87242249b1395
+#ifndef MH136b178d15a155e63419dbb65919ab8d8102e4a2
+#define MH136b178d15a155e63419dbb65919ab8d8102e4a2
 
 // ELI5 Variant.
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 namespace eli5 {
 
 // Variant: a statically-checked  type-safe union. Contains one of multiple
@@ -12,12 +29,15 @@ namespace eli5 {
 // wrapper around a C++ union. We add a single numeric field to
 // track which of the union's members is set.
 //
-// We keep the implementation simple by allowing at most 16 values to
-// multiplexed in a variant. The basic idea is to create a variant that
-// always contains 16 values. For the types not set by the user, we default
-// to empty structs.
+// A Variant can hold any number of types. The storage is a block of bytes
+// large enough and aligned enough for the biggest of them, followed by the
+// numeric field, which is the smallest unsigned integer type that can count
+// the types. That is a single byte unless there are more than 255 of them,
+// so the field fits in what would otherwise be padding at the end:
+// sizeof(Variant<int, float>) is 8.
 //
-// The operations provided are: construct, get, check, and dispatch.
+// The operations provided are: construct, assign, emplace, get, check, and
+// dispatch.
 //
 // Example:
 //
@@ -63,315 +83,384 @@ namespace eli5 {
 // of each of the types in the variant. The Variant will then invoke the
 // function corresponding to the type within it, passing the value as an
 // argument. The functions are "bunched together" as multiple overloaded
-// functions
-// named 'Run' in a struct. The struct is passed as a parameter to
-// the variant. See example below.
+// functions named 'Run' in a struct. The struct is passed as a parameter to
+// the variant. See example above.
+//
+// A variant can be set to a value of a different type by assigning another
+// variant to it, or by building the new value in place with Emplace:
 //
-// Construction is the only way to set a value. You can't set a different
-// type after construction. This is more of a design decision,
-// rather than a limitaiton of C++. This may change in the future.
+//  v = Variant<int, double>{2};     // Now holds an int.
+//  v.Emplace<double>(3.5);          // Now holds a double again.
+//
+// Variants can be moved, so vectors of variants holding strings move them
+// instead of copying them when growing.
 //
 // Suggested reading order (search for these words using your editor):
 //   Introduction (you just finished this section)
 //   CoreClassDefinition (read through the entire class, esp. DispatchUsing)
-//   TypeToIndex (to understand how checking works)
+//   IndexOf (to understand how checking works)
+//   DispatchTable (to understand how the stored value is found)
+//   VariantStorage and VariantBase (to understand copying and destruction)
 //   IndexedGet
 namespace internal {
 
-// A set of dummy empty types for variant template types that are not set.
-struct ES0 {
-  bool operator==(const ES0& other) const { return true; }
-};
-struct ES1 {
-  bool operator==(const ES1& other) const { return true; }
-};
-struct ES2 {
-  bool operator==(const ES2& other) const { return true; }
-};
-struct ES3 {
-  bool operator==(const ES3& other) const { return true; }
-};
-struct ES4 {
-  bool operator==(const ES4& other) const { return true; }
-};
-struct ES5 {
-  bool operator==(const ES5& other) const { return true; }
-};
-struct ES6 {
-  bool operator==(const ES6& other) const { return true; }
-};
-struct ES7 {
-  bool operator==(const ES7& other) const { return true; }
-};
-struct ES8 {
-  bool operator==(const ES8& other) const { return true; }
-};
-struct ES9 {
-  bool operator==(const ES9& other) const { return true; }
-};
-struct ES10 {
-  bool operator==(const ES10& other) const { return true; }
-};
-struct ES11 {
-  bool operator==(const ES11& other) const { return true; }
-};
-struct ES12 {
-  bool operator==(const ES12& other) const { return true; }
-};
-struct ES13 {
-  bool operator==(const ES13& other) const { return true; }
-};
-struct ES14 {
-  bool operator==(const ES14& other) const { return true; }
-};
-struct ES15 {
-  bool operator==(const ES15& other) const { return true; }
-};
+// Contains<T, Ts...>::value is true iff T is one of Ts.
+template <typename T, typename... Ts>
+struct Contains : std::false_type {};
 
-// Some templated structs and specialiations so that we can do:
-// Variant<double, int> v{1.25}; and then
-// TypeToIndex<Variant, double>::index and get 0 etc. This will be used
-// in our getters to error out if we try to get a different type than
-// we put in.
-template <typename VariantType, typename T>
-struct TypeToIndex {
-  // Only specializations will be used.
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType0> {
-  static constexpr int index = 0;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType1> {
-  static constexpr int index = 1;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType2> {
-  static constexpr int index = 2;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType3> {
-  static constexpr int index = 3;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType4> {
-  static constexpr int index = 4;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType5> {
-  static constexpr int index = 5;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType6> {
-  static constexpr int index = 6;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType7> {
-  static constexpr int index = 7;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType8> {
-  static constexpr int index = 8;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType9> {
-  static constexpr int index = 9;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType10> {
-  static constexpr int index = 10;
-};
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType11> {
-  static constexpr int index = 11;
+template <typename T, typename... Rest>
+struct Contains<T, T, Rest...> : std::true_type {};
+
+template <typename T, typename U, typename... Rest>
+struct Contains<T, U, Rest...> : Contains<T, Rest...> {};
+
+// IndexOf<T, Ts...>::index is the position of T in Ts. This will be used
+// in our getters to error out at compile time if we try to get a type the
+// variant can't hold. If T appears more than once, the first one is used.
+template <typename T, typename... Ts>
+struct IndexOf {
+  static_assert(Contains<T, Ts...>::value,
+                "Type is not one of the variant's types");
 };
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType12> {
-  static constexpr int index = 12;
+
+template <typename T, typename... Rest>
+struct IndexOf<T, T, Rest...> {
+  static constexpr size_t index = 0;
 };
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType13> {
-  static constexpr int index = 13;
+
+template <typename T, typename U, typename... Rest>
+struct IndexOf<T, U, Rest...> {
+  static constexpr size_t index = 1 + IndexOf<T, Rest...>::index;
 };
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType14> {
-  static constexpr int index = 14;
+
+// TypeAt<N, Ts...> is the Nth of Ts.
+template <size_t N, typename... Ts>
+using TypeAt = typename std::tuple_element<N, std::tuple<Ts...>>::type;
+
+// AllOf<b...>::value is true iff all of b are.
+template <bool... b>
+struct BoolPack {};
+
+template <bool... b>
+using AllOf = std::is_same<BoolPack<true, b...>, BoolPack<b..., true>>;
+
+// The largest of the arguments, for sizing the storage.
+template <typename T>
+constexpr T MaxOf(T n) { return n; }
+
+template <typename T, typename... Rest>
+constexpr T MaxOf(T a, T b, Rest... rest) {
+  return MaxOf(a > b ? a : b, rest...);
+}
+
+// The smallest unsigned integer type that can hold the numbers 0 to N.
+template <size_t N>
+using SmallestUnsigned = typename std::conditional<
+    N <= UINT8_MAX, uint8_t,
+    typename std::conditional<N <= UINT16_MAX, uint16_t,
+                              uint32_t>::type>::type;
+
+// Overloads<Ts...>::Pick has one overload per type in Ts, each taking and
+// returning that type. The return type of calling it with a value is the type
+// the Variant's constructor builds from that value: the same one overload
+// resolution would pick if the Variant had a constructor for each type.
+// Calling it fails to compile if no type fits, or if more than one fits
+// equally well.
+template <typename... Ts>
+struct Overloads {
+  static void Pick();
 };
-template <typename VariantType>
-struct TypeToIndex<VariantType, typename VariantType::ValueType15> {
-  static constexpr int index = 15;
+
+template <typename T, typename... Rest>
+struct Overloads<T, Rest...> : Overloads<Rest...> {
+  using Overloads<Rest...>::Pick;
+  static T Pick(T);
 };
+
+template <typename U, typename... Ts>
+using ConvertedType = decltype(Overloads<Ts...>::Pick(std::declval<U>()));
+
+// DispatchTable
+// Calls a function with the value stored in a variant, as its actual type.
+// DispatchTable<VariantType, F>::functions has one function pointer per type,
+// built at compile time, the Ith of which calls f with the variant's Ith
+// type. Indexing it with field_num and calling through the pointer is a
+// single indirect jump, however many types there are, with no chain of
+// comparisons. The last entry is for a variant holding nothing.
+//
+// The result is what f returns, converted to a type common to all the types
+// it is called with (e.g., double if it returns int for some and double for
+// others).
+template <size_t I, typename Result, typename VariantType, typename F>
+Result CallWithValue(VariantType& v, F& f) {
+  return f(v.template UncheckedGet<I>());
 }
 
-// CoreClassDefinition:
-template <typename T0 = internal::ES0, typename T1 = internal::ES1,
-          typename T2 = internal::ES2, typename T3 = internal::ES3,
-          typename T4 = internal::ES4, typename T5 = internal::ES5,
-          typename T6 = internal::ES6, typename T7 = internal::ES7,
-          typename T8 = internal::ES8, typename T9 = internal::ES9,
-          typename T10 = internal::ES10, typename T11 = internal::ES11,
-          typename T12 = internal::ES12, typename T13 = internal::ES13,
-          typename T14 = internal::ES14, typename T15 = internal::ES15>
-struct Variant {
-  // The union that multiplexes the values.
-  union U {
-    // Wrap in a struct so that using the same type twice will work.
-    // E.g., Variant<int, int> x.
-    struct {
-      T0 v;
-    } s0;
-    struct {
-      T1 v;
-    } s1;
-    struct {
-      T2 v;
-    } s2;
-    struct {
-      T3 v;
-    } s3;
-    struct {
-      T4 v;
-    } s4;
-    struct {
-      T5 v;
-    } s5;
-    struct {
-      T6 v;
-    } s6;
-    struct {
-      T7 v;
-    } s7;
-    struct {
-      T8 v;
-    } s8;
-    struct {
-      T9 v;
-    } s9;
-    struct {
-      T10 v;
-    } s10;
-    struct {
-      T11 v;
-    } s11;
-    struct {
-      T12 v;
-    } s12;
-    struct {
-      T13 v;
-    } s13;
-    struct {
-      T14 v;
-    } s14;
-    struct {
-      T15 v;
-    } s15;
-    U(){};
-    ~U(){};
-    U(const U& other) {}
-  };
-
-  U storage;
+// A void function is not called when the variant holds nothing. Anything
+// else must have a value to return, so there has to be one to call it with.
+template <typename Result, typename VariantType, typename F>
+typename std::enable_if<!std::is_void<Result>::value, Result>::type
+CallWithNoValue(VariantType& v, F& f) {
+  assert(false && "Variant holds no value");
+  std::abort();
+}
 
-  // Keep field num second so that accidental usage of Variant as a native
-  // union has a chance to succeed.
-  int field_num = -1;
+template <typename Result, typename VariantType, typename F>
+typename std::enable_if<std::is_void<Result>::value>::type CallWithNoValue(
+    VariantType& v, F& f) {}
 
-  // Constructors to initialize the union from each of member types.
-  Variant(const T0& v) {
-    field_num = 0;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s0.v) T0(v);
-  }
-  Variant(const T1& v) {
-    field_num = 1;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s1.v) T1(v);
-  }
-  Variant(const T2& v) {
-    field_num = 2;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s2.v) T2(v);
-  }
-  Variant(const T3& v) {
-    field_num = 3;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s3.v) T3(v);
-  }
-  Variant(const T4& v) {
-    field_num = 4;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s4.v) T4(v);
-  }
-  Variant(const T5& v) {
-    field_num = 5;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s5.v) T5(v);
+template <typename VariantType, typename F,
+          typename Indices =
+              std::make_index_sequence<std::decay_t<VariantType>::kNumTypes>>
+struct DispatchTable;
+
+template <typename VariantType, typename F, size_t... Is>
+struct DispatchTable<VariantType, F, std::index_sequence<Is...>> {
+  typedef typename std::common_type<decltype(std::declval<F&>()(
+      std::declval<VariantType&>().template UncheckedGet<Is>()))...>::type
+      Result;
+
+  typedef Result (*Function)(VariantType&, F&);
+
+  static constexpr Function functions[] = {
+      &CallWithValue<Is, Result, VariantType, F>...,
+      &CallWithNoValue<Result, VariantType, F>};
+
+  static Result Call(VariantType& v, F& f) {
+    return functions[v.field_num](v, f);
   }
-  Variant(const T6& v) {
-    field_num = 6;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s6.v) T6(v);
+};
+
+template <typename VariantType, typename F, size_t... Is>
+constexpr typename DispatchTable<VariantType, F,
+                                 std::index_sequence<Is...>>::Function
+    DispatchTable<VariantType, F, std::index_sequence<Is...>>::functions[];
+
+// VariantStorage
+// The values and the numeric field of a Variant<Ts...>, and the low-level
+// operations on them. It declares no constructors, assignment operators or
+// destructor, so it is trivially copyable. VariantBase below adds them for
+// the types that need them.
+template <typename... Ts>
+struct VariantStorage {
+  static_assert(sizeof...(Ts) > 0, "A Variant needs at least one type");
+
+  // The type of field_num.
+  typedef SmallestUnsigned<sizeof...(Ts)> Tag;
+
+  // The value of field_num when the variant holds nothing. The types are
+  // numbered from 0, so this is one past the last of them.
+  static constexpr Tag kNoValue = sizeof...(Ts);
+
+  static constexpr size_t kNumTypes = sizeof...(Ts);
+
+  // The bytes that multiplex the values. All of them start at its address.
+  alignas(Ts...) unsigned char storage[MaxOf(sizeof(Ts)...)];
+
+  // Keep field num second so that accidental usage of Variant as a native
+  // union has a chance to succeed. The storage's size is a multiple of its
+  // alignment, so field_num goes right after it, and the padding needed to
+  // align the next Variant in an array is as small as it can be.
+  Tag field_num = kNoValue;
+
+  // Calls the destructor of the stored value, if any, and leaves the variant
+  // holding nothing.
+  void Destroy() {
+    Visit([](auto& value) {
+      typedef std::decay_t<decltype(value)> T;
+      // Directly call the destructor.
+      value.~T();
+    });
+    field_num = kNoValue;
   }
-  Variant(const T7& v) {
-    field_num = 7;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s7.v) T7(v);
+
+  // Calls f with a reference to the stored value and returns the result. If
+  // the variant holds nothing, f must return void and isn't called.
+  template <typename F>
+  decltype(auto) Visit(F&& f) {
+    return DispatchTable<VariantStorage, F>::Call(*this, f);
   }
-  Variant(const T8& v) {
-    field_num = 8;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s8.v) T8(v);
+
+  template <typename F>
+  decltype(auto) Visit(F&& f) const {
+    return DispatchTable<const VariantStorage, F>::Call(*this, f);
   }
-  Variant(const T9& v) {
-    field_num = 9;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s9.v) T9(v);
+
+  // The stored value as the Nth type, without checking that it is the one
+  // stored.
+  template <size_t N>
+  TypeAt<N, Ts...>& UncheckedGet() { return UncheckedAs<TypeAt<N, Ts...>>(); }
+
+  template <size_t N>
+  const TypeAt<N, Ts...>& UncheckedGet() const {
+    return UncheckedAs<TypeAt<N, Ts...>>();
   }
-  Variant(const T10& v) {
-    field_num = 10;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s10.v) T10(v);
+
+  // The stored value as a T, without checking that it is one.
+  template <typename T>
+  T& UncheckedAs() { return *reinterpret_cast<T*>(&storage); }
+
+  template <typename T>
+  const T& UncheckedAs() const { return *reinterpret_cast<const T*>(&storage); }
+};
+
+template <typename... Ts>
+constexpr typename VariantStorage<Ts...>::Tag VariantStorage<Ts...>::kNoValue;
+
+template <typename... Ts>
+constexpr size_t VariantStorage<Ts...>::kNumTypes;
+
+// VariantBase
+// Copying, moving and destroying a Variant. If all the types are trivially
+// copyable, e.g., int and double, the compiler's own versions are used, so
+// the Variant is trivially copyable and trivially destructible too: copying
+// it copies its bytes and destroying it does nothing. A vector of them then
+// copies and grows with memcpy, and they can be written to a file or put in
+// shared memory as they are.
+template <bool kTriviallyCopyable, typename... Ts>
+struct VariantBase : VariantStorage<Ts...> {};
+
+// Otherwise, e.g., when one of the types is a string, copies, moves and
+// destruction go through the stored value's own constructors, assignment
+// operators and destructor.
+template <typename... Ts>
+struct VariantBase<false, Ts...> : VariantStorage<Ts...> {
+  VariantBase() = default;
+
+  ~VariantBase() { this->Destroy(); }
+
+  VariantBase(const VariantBase& other) {
+    other.Visit([this](const auto& value) {
+      new (&this->storage) std::decay_t<decltype(value)>(value);
+    });
+    this->field_num = other.field_num;
   }
-  Variant(const T11& v) {
-    field_num = 11;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s11.v) T11(v);
+
+  // Moves the value out of other, which keeps its type but is left holding
+  // a moved-from value. noexcept when all the types can be moved without
+  // throwing, so that vectors of variants move them when growing.
+  VariantBase(VariantBase&& other) noexcept(
+      AllOf<std::is_nothrow_move_constructible<Ts>::value...>::value) {
+    other.Visit([this](auto& value) {
+      new (&this->storage) std::decay_t<decltype(value)>(std::move(value));
+    });
+    this->field_num = other.field_num;
   }
-  Variant(const T12& v) {
-    field_num = 12;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s12.v) T12(v);
+
+  // Assignment. If both variants hold the same type, the value is assigned,
+  // so that, e.g., a string can reuse its buffer. Otherwise the old value is
+  // destroyed and the new one constructed in its place. If that throws, the
+  // variant is left holding nothing.
+  VariantBase& operator=(const VariantBase& other) {
+    if (this == &other) {
+      return *this;
+    }
+    if (this->field_num == other.field_num) {
+      other.Visit([this](const auto& value) {
+        this->template UncheckedAs<std::decay_t<decltype(value)>>() = value;
+      });
+      return *this;
+    }
+    this->Destroy();
+    other.Visit([this](const auto& value) {
+      new (&this->storage) std::decay_t<decltype(value)>(value);
+    });
+    this->field_num = other.field_num;
+    return *this;
   }
-  Variant(const T13& v) {
-    field_num = 13;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s13.v) T13(v);
+
+  VariantBase& operator=(VariantBase&& other) {
+    if (this == &other) {
+      return *this;
+    }
+    if (this->field_num == other.field_num) {
+      other.Visit([this](auto& value) {
+        this->template UncheckedAs<std::decay_t<decltype(value)>>() =
+            std::move(value);
+      });
+      return *this;
+    }
+    this->Destroy();
+    other.Visit([this](auto& value) {
+      new (&this->storage) std::decay_t<decltype(value)>(std::move(value));
+    });
+    this->field_num = other.field_num;
+    return *this;
   }
-  Variant(const T14& v) {
-    field_num = 14;
-    // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s14.v) T14(v);
+};
+
+// The hash of a value held by a variant. Integers and enums are their own
+// hash, as with std::hash. Floating point numbers are hashed by their bits,
+// which is cheaper than std::hash, which hashes their bytes as a string.
+// Other types use std::hash.
+template <typename T>
+std::enable_if_t<std::is_integral<T>::value || std::is_enum<T>::value,
+                 uint64_t>
+HashValue(const T& value) { return static_cast<uint64_t>(value); }
+
+template <typename T>
+std::enable_if_t<std::is_floating_point<T>::value &&
+                     sizeof(T) <= sizeof(uint64_t),
+                 uint64_t>
+HashValue(const T& value) {
+  // 0.0 and -0.0 are equal, so they must hash the same.
+  if (value == 0) {
+    return 0;
   }
-  Variant(const T15& v) {
-    field_num = 15;
+  uint64_t bits = 0;
+  memcpy(&bits, &value, sizeof(value));
+  return bits;
+}
+
+template <typename T>
+std::enable_if_t<!std::is_integral<T>::value && !std::is_enum<T>::value &&
+                     !(std::is_floating_point<T>::value &&
+                       sizeof(T) <= sizeof(uint64_t)),
+                 uint64_t>
+HashValue(const T& value) { return std::hash<T>()(value); }
+
+// Mixes the bits of x so that each affects the low ones, which hash tables
+// use to pick a bucket. The finalizer of MurmurHash3.
+inline uint64_t MixBits(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+}
+
+// CoreClassDefinition:
+// The storage, copying and destruction come from the base classes above.
+template <typename... Ts>
+struct Variant
+    : internal::VariantBase<
+          internal::AllOf<std::is_trivially_copyable<Ts>::value...>::value,
+          Ts...> {
+  typedef internal::VariantBase<
+      internal::AllOf<std::is_trivially_copyable<Ts>::value...>::value, Ts...>
+      Base;
+  typedef typename Base::Tag Tag;
+  using Base::kNoValue;
+  using Base::kNumTypes;
+  using Base::storage;
+  using Base::field_num;
+  using Base::Destroy;
+  using Base::Visit;
+
+  // Constructor to initialize the storage from a value of any of the types,
+  // or of a type that converts to one of them. Picks the type the same way
+  // overload resolution would if there were one constructor per type.
+  template <typename U,
+            typename = typename std::enable_if<!std::is_same<
+                typename std::decay<U>::type, Variant>::value>::type,
+            typename T = internal::ConvertedType<U&&, Ts...>>
+  Variant(U&& v) {
     // Placement new more precise than assignment in the general case.
-    // We're doing that instead of: storage.si = v.
-    new (&storage.s15.v) T15(v);
+    new (&storage) T(std::forward<U>(v));
+    field_num = IndexOf<T>();
   }
 
   // Workaround for C's original sin: no native string type. In C++, values
@@ -387,160 +476,18 @@ struct Variant {
   // one of the types. See test Test_ListInitVector for an example.
   Variant(const char* ca) : Variant(string(ca)){};
 
-  ~Variant() {
-    // Call destructor of stored value.
-    switch (field_num) {
-      case 0:
-        // Directly call the destructor.
-        storage.s0.v.~T0();
-        break;
-      case 1:
-        // Directly call the destructor.
-        storage.s1.v.~T1();
-        break;
-      case 2:
-        // Directly call the destructor.
-        storage.s2.v.~T2();
-        break;
-      case 3:
-        // Directly call the destructor.
-        storage.s3.v.~T3();
-        break;
-      case 4:
-        // Directly call the destructor.
-        storage.s4.v.~T4();
-        break;
-      case 5:
-        // Directly call the destructor.
-        storage.s5.v.~T5();
-        break;
-      case 6:
-        // Directly call the destructor.
-        storage.s6.v.~T6();
-        break;
-      case 7:
-        // Directly call the destructor.
-        storage.s7.v.~T7();
-        break;
-      case 8:
-        // Directly call the destructor.
-        storage.s8.v.~T8();
-        break;
-      case 9:
-        // Directly call the destructor.
-        storage.s9.v.~T9();
-        break;
-      case 10:
-        // Directly call the destructor.
-        storage.s10.v.~T10();
-        break;
-      case 11:
-        // Directly call the destructor.
-        storage.s11.v.~T11();
-        break;
-      case 12:
-        // Directly call the destructor.
-        storage.s12.v.~T12();
-        break;
-      case 13:
-        // Directly call the destructor.
-        storage.s13.v.~T13();
-        break;
-      case 14:
-        // Directly call the destructor.
-        storage.s14.v.~T14();
-        break;
-      case 15:
-        // Directly call the destructor.
-        storage.s15.v.~T15();
-        break;
-    }
-  }
-
-  Variant(const Variant& other) {
-    field_num = other.field_num;
-    switch (field_num) {
-      case 0:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s0.v) T0(other.storage.s0.v);
-        break;
-      case 1:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s1.v) T1(other.storage.s1.v);
-        break;
-      case 2:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s2.v) T2(other.storage.s2.v);
-        break;
-      case 3:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s3.v) T3(other.storage.s3.v);
-        break;
-      case 4:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s4.v) T4(other.storage.s4.v);
-        break;
-      case 5:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s5.v) T5(other.storage.s5.v);
-        break;
-      case 6:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s6.v) T6(other.storage.s6.v);
-        break;
-      case 7:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s7.v) T7(other.storage.s7.v);
-        break;
-      case 8:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s8.v) T8(other.storage.s8.v);
-        break;
-      case 9:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s9.v) T9(other.storage.s9.v);
-        break;
-      case 10:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s10.v) T10(other.storage.s10.v);
-        break;
-      case 11:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s11.v) T11(other.storage.s11.v);
-        break;
-      case 12:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s12.v) T12(other.storage.s12.v);
-        break;
-      case 13:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s13.v) T13(other.storage.s13.v);
-        break;
-      case 14:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s14.v) T14(other.storage.s14.v);
-        break;
-      case 15:
-        // Placement new more precise than assignment in the general case.
-        // We're doing that instead of: storage.si = other.storage.si.
-        new (&storage.s15.v) T15(other.storage.s15.v);
-        break;
-    }
+  // Destroys the current value and builds a T from args in its place,
+  // without copying or moving it. Returns the new value. If T's constructor
+  // throws, the variant is left holding nothing.
+  //
+  // Variant<int, vector<int>> v{1};
+  // v.Emplace<vector<int>>(1000, 7);  // A vector of 1000 sevens.
+  template <typename T, typename... Args>
+  T& Emplace(Args&&... args) {
+    Destroy();
+    T* value = new (&storage) T(std::forward<Args>(args)...);
+    field_num = IndexOf<T>();
+    return *value;
   }
 
   // Typed getter function. Allows us to do:
@@ -550,10 +497,10 @@ struct Variant {
   //
   // Syntax sugar around type conversion operator.
   template <typename T>
-  T& GetOrDie() {
-    assert((internal::TypeToIndex<Variant, T>::index) == field_num);
-    return static_cast<T&>(*this);
-  }
+  T& GetOrDie() { return static_cast<T&>(*this); }
+
+  template <typename T>
+  const T& GetOrDie() const { return static_cast<const T&>(*this); }
 
   // Check function. Check if variant holds a certain type.
   // Variant<int, double> v{1.50};
@@ -561,428 +508,1070 @@ struct Variant {
   // bool has_double = v.Is<double>();  // true
   // bool has_int = v.Is<int>();  // false
   template <typename T>
-  bool Is() {
-    return ((internal::TypeToIndex<Variant, T>::index) == field_num);
-  }
+  bool Is() const { return IndexOf<T>() == field_num; }
 
   // Typed getter that returns a mutable reference.
   // A non-const refernce to member, for direct poking.
   template <typename T>
-  T& Mutable() const {
-    assert((internal::TypeToIndex<Variant, T>::index) == field_num);
-    return static_cast<T&>(*this);
-  }
+  T& Mutable() { return static_cast<T&>(*this); }
 
   // Type conversion operators. Allows concise code like:
   // Variant<double, int> v{1.25};
   // ...
   // double x{v};
-  explicit operator T0&() {
-    assert(field_num == 0);
-    return storage.s0.v;
+  template <typename T, typename = typename std::enable_if<
+                            internal::Contains<T, Ts...>::value>::type>
+  explicit operator T&() {
+    assert(Is<T>());
+    return this->template UncheckedAs<T>();
   }
-  explicit operator T1&() {
-    assert(field_num == 1);
-    return storage.s1.v;
-  }
-  explicit operator T2&() {
-    assert(field_num == 2);
-    return storage.s2.v;
+
+  // const version of type conversion operator.
+  template <typename T, typename = typename std::enable_if<
+                            internal::Contains<T, Ts...>::value>::type>
+  explicit operator const T&() const {
+    assert(Is<T>());
+    return this->template UncheckedAs<T>();
   }
-  explicit operator T3&() {
-    assert(field_num == 3);
-    return storage.s3.v;
+
+  // Applies a function to the stored value. If we have N types in the variant
+  // we will need N functions to be passed in, so that we can pick the
+  // appropriate one and invoke it. We require that the N functions be bundled
+  // up in a struct or class, with name 'Run', and taking a single parameter
+  // which is the type to which that function should be applied.
+  //
+  // Returns what Run returns, if anything:
+  //
+  //  struct Size {
+  //    size_t Run(int x) { return sizeof(x); }
+  //    size_t Run(const string& s) { return s.size(); }
+  //  };
+  //  size_t size = v.DispatchUsing(Size());
+  template <typename Dispatcher>
+  decltype(auto) DispatchUsing(Dispatcher&& dispatcher) const {
+    return Visit([&dispatcher](const auto& value) -> decltype(auto) {
+      return dispatcher.Run(value);
+    });
   }
-  explicit operator T4&() {
-    assert(field_num == 4);
-    return storage.s4.v;
+
+  // Check if two variants are equal. Iff the field types are same and values
+  // are equal by operator==.
+  bool operator==(const Variant& other) const {
+    if (field_num != other.field_num) {
+      return false;
+    }
+    bool equal = true;
+    Visit([&other, &equal](const auto& value) {
+      typedef std::decay_t<decltype(value)> T;
+      equal = value == other.template UncheckedAs<T>();
+    });
+    return equal;
   }
-  explicit operator T5&() {
-    assert(field_num == 5);
-    return storage.s5.v;
+
+  // Inequality. Literally negation of equality.
+  bool operator!=(const Variant& other) const { return !(*this == other); }
+
+  // Orders variants by the position of their type among the types, and
+  // those of the same type by operator< on their values, so that variants
+  // can be sorted and be keys of a std::map. A variant holding nothing goes
+  // after all others.
+  bool operator<(const Variant& other) const {
+    if (field_num != other.field_num) {
+      return field_num < other.field_num;
+    }
+    bool less = false;
+    Visit([&other, &less](const auto& value) {
+      typedef std::decay_t<decltype(value)> T;
+      less = value < other.template UncheckedAs<T>();
+    });
+    return less;
   }
-  explicit operator T6&() {
-    assert(field_num == 6);
-    return storage.s6.v;
+
+  bool operator>(const Variant& other) const { return other < *this; }
+  bool operator<=(const Variant& other) const { return !(other < *this); }
+  bool operator>=(const Variant& other) const { return !(*this < other); }
+
+  // A hash of the type and the value, consistent with operator==. Used by
+  // std::hash, so that variants can be keys of a std::unordered_map.
+  size_t Hash() const {
+    uint64_t hash = 0;
+    Visit([&hash](const auto& value) { hash = internal::HashValue(value); });
+    // Adding the numeric field times an odd constant makes equal values of
+    // different types hash differently.
+    return internal::MixBits(hash + field_num * 0x9e3779b97f4a7c15ULL);
   }
-  explicit operator T7&() {
-    assert(field_num == 7);
-    return storage.s7.v;
+
+  // The position of T among the types.
+  template <typename T>
+  static constexpr size_t IndexOf() {
+    return internal::IndexOf<T, Ts...>::index;
   }
-  explicit operator T8&() {
-    assert(field_num == 8);
-    return storage.s8.v;
+};
+
+namespace internal {
+
+// TypeToIndex<Variant, T>::index is the position of T in the variant's types.
+template <typename VariantType, typename T>
+struct TypeToIndex {
+  // Only specializations will be used.
+};
+
+template <typename T, typename... Ts>
+struct TypeToIndex<Variant<Ts...>, T> : IndexOf<T, Ts...> {};
+
+// IndexedGet
+// Indexed getter for those that prefer this style as opposed to the typed
+// getter member function. Allows us to do:
+//
+// Variant<int, double> v{1.25};
+// ...
+// double x = eli::GetOrDie<1>(v);
+//
+// The key trick is in going from a number like 1 to the type 'double'.
+// TypeHelper<N, Variant>::value_type is the variant's Nth type, so that we
+// can express all the return values of the indexed getter function using the
+// same literal program text.
+template <int N, typename VariantType>
+struct TypeHelper {
+  // This should never be used. Only the specializations below will be used.
+};
+
+template <int N, typename... Ts>
+struct TypeHelper<N, Variant<Ts...>> {
+  typedef TypeAt<N, Ts...> value_type;
+};
+
+}
+
+// The indexed getter.
+template <int N, typename VariantType>
+typename internal::TypeHelper<N, VariantType>::value_type& GetOrDie(
+    VariantType& v) {
+  assert(v.field_num == N);
+  return v.template UncheckedGet<N>();
+}
+
+// MultiDispatch
+// Dispatches on the types held by several variants at once, calling the
+// dispatcher's Run with all their values, and returns what Run returns:
+//
+//  typedef Variant<int64_t, double, string> Value;
+//  struct Add {
+//    Value Run(int64_t a, int64_t b) { return a + b; }
+//    Value Run(int64_t a, double b) { return a + b; }
+//    ...
+//    Value Run(const string& a, const string& b) { return a + b; }
+//  };
+//  Value sum = DispatchUsing(Add(), Value{1}, Value{2.5});  // 3.5
+//
+// The dispatcher needs a Run for every combination of types. Like the
+// member DispatchUsing, this jumps through a compile-time table of
+// functions, one per combination, so dispatching on two variants is a single
+// indirect call rather than one per variant. The table has the product of
+// the variants' numbers of types as entries, e.g., 9 for two variants of 3,
+// plus one for when a variant holds nothing. Then, as with the member
+// DispatchUsing, a Run that returns void isn't called, and any other aborts.
+namespace internal {
+
+// Ks are the positions of the variants, 0 to sizeof...(Variants) - 1, and Fs
+// the positions in the table, one per combination of types. A combination
+// is numbered like the digits of a number in which the kth digit is the
+// field_num of the kth variant, so the last variant's changes fastest.
+template <typename Dispatcher, typename Ks, typename Fs, typename... Variants>
+struct MultiDispatchTable;
+
+template <typename Dispatcher, size_t... Ks, size_t... Fs,
+          typename... Variants>
+struct MultiDispatchTable<Dispatcher, std::index_sequence<Ks...>,
+                          std::index_sequence<Fs...>, Variants...> {
+  // The value of the kth digit.
+  static constexpr size_t Stride(size_t k) {
+    const size_t num_types[] = {Variants::kNumTypes...};
+    size_t stride = 1;
+    for (size_t i = k + 1; i < sizeof...(Variants); ++i) {
+      stride *= num_types[i];
+    }
+    return stride;
   }
-  explicit operator T9&() {
-    assert(field_num == 9);
-    return storage.s9.v;
+
+  // The kth digit of combination f: the field_num of the kth variant.
+  static constexpr size_t Digit(size_t f, size_t k) {
+    const size_t num_types[] = {Variants::kNumTypes...};
+    return f / Stride(k) % num_types[k];
   }
-  explicit operator T10&() {
-    assert(field_num == 10);
-    return storage.s10.v;
+
+  template <size_t F>
+  using RunResult = decltype(std::declval<Dispatcher&>().Run(
+      std::declval<const Variants&>()
+          .template UncheckedGet<Digit(F, Ks)>()...));
+
+  typedef typename std::common_type<RunResult<Fs>...>::type Result;
+
+  typedef Result (*Function)(Dispatcher&, const Variants&...);
+
+  template <size_t F>
+  static Result CallWithValues(Dispatcher& dispatcher,
+                               const Variants&... variants) {
+    return dispatcher.Run(
+        variants.template UncheckedGet<Digit(F, Ks)>()...);
   }
-  explicit operator T11&() {
-    assert(field_num == 11);
-    return storage.s11.v;
+
+  // Like CallWithNoValue, for when any of the variants holds nothing.
+  template <typename R>
+  static std::enable_if_t<!std::is_void<R>::value, R> CallWithNoValues(
+      Dispatcher& dispatcher, const Variants&... variants) {
+    assert(false && "Variant holds no value");
+    std::abort();
   }
-  explicit operator T12&() {
-    assert(field_num == 12);
-    return storage.s12.v;
+
+  template <typename R>
+  static std::enable_if_t<std::is_void<R>::value> CallWithNoValues(
+      Dispatcher& dispatcher, const Variants&... variants) {}
+
+  static constexpr Function functions[] = {&CallWithValues<Fs>...,
+                                           &CallWithNoValues<Result>};
+
+  static Result Call(Dispatcher& dispatcher, const Variants&... variants) {
+    size_t f = 0;
+    bool has_values = true;
+    int unused[] = {
+        (has_values = has_values && variants.field_num != variants.kNoValue,
+         f += variants.field_num * Stride(Ks), 0)...};
+    static_cast<void>(unused);
+    return functions[has_values ? f : sizeof...(Fs)](dispatcher, variants...);
   }
-  explicit operator T13&() {
-    assert(field_num == 13);
-    return storage.s13.v;
+};
+
+template <typename Dispatcher, size_t... Ks, size_t... Fs,
+          typename... Variants>
+constexpr typename MultiDispatchTable<Dispatcher, std::index_sequence<Ks...>,
+                                      std::index_sequence<Fs...>,
+                                      Variants...>::Function
+    MultiDispatchTable<Dispatcher, std::index_sequence<Ks...>,
+                       std::index_sequence<Fs...>, Variants...>::functions[];
+
+template <typename... Ns>
+constexpr size_t Product(Ns... ns) {
+  const size_t factors[] = {1, ns...};
+  size_t product = 1;
+  for (size_t factor : factors) {
+    product *= factor;
   }
-  explicit operator T14&() {
-    assert(field_num == 14);
-    return storage.s14.v;
+  return product;
+}
+
+}
+
+template <typename Dispatcher, typename... Variants>
+decltype(auto) DispatchUsing(Dispatcher&& dispatcher,
+                             const Variants&... variants) {
+  typedef internal::MultiDispatchTable<
+      std::remove_reference_t<Dispatcher>,
+      std::index_sequence_for<Variants...>,
+      std::make_index_sequence<internal::Product(Variants::kNumTypes...)>,
+      Variants...>
+      Table;
+  return Table::Call(dispatcher, variants...);
+}
+
+// A contiguous run of T's, given by a pointer and a size.
+template <typename T>
+struct Span {
+  T* data;
+  size_t size;
+
+  T* begin() const { return data; }
+  T* end() const { return data + size; }
+  T& operator[](size_t i) const { return data[i]; }
+};
+
+// TagScan
+// Queries over arrays of numeric fields, e.g., VariantVector::tags(): how
+// many elements hold a type, where they are, and whether they all hold the
+// same one. On x86 they compare 16 or 32 fields at a time with SSE2 or AVX2
+// instructions, picked when first called according to what the processor
+// supports. Elsewhere they go a field at a time.
+//
+//  VariantVector<int64_t, double> vv;
+//  ...
+//  size_t num_doubles = CountTag(vv.tags(), 1);
+namespace internal {
+
+inline size_t CountTagScalar(const uint8_t* tags, size_t size, uint8_t tag) {
+  size_t count = 0;
+  for (size_t i = 0; i < size; ++i) {
+    count += tags[i] == tag;
   }
-  explicit operator T15&() {
-    assert(field_num == 15);
-    return storage.s15.v;
+  return count;
+}
+
+inline void FindTagScalar(const uint8_t* tags, size_t begin, size_t size,
+                          uint8_t tag, std::vector<size_t>* indices) {
+  for (size_t i = begin; i < size; ++i) {
+    if (tags[i] == tag) {
+      indices->push_back(i);
+    }
   }
+}
 
-  // const version of type conversion operator.
-  explicit operator const T0&() const {
-    assert(field_num == 0);
-    return storage.s0.v;
+inline bool AllTagScalar(const uint8_t* tags, size_t size, uint8_t tag) {
+  for (size_t i = 0; i < size; ++i) {
+    if (tags[i] != tag) {
+      return false;
+    }
   }
-  explicit operator const T1&() const {
-    assert(field_num == 1);
-    return storage.s1.v;
+  return true;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define ELI5_VARIANT_TAG_SCAN_X86 1
+
+// SSE2 is part of x86-64, so it's always there.
+inline size_t CountTagSse2(const uint8_t* tags, size_t size, uint8_t tag) {
+  const __m128i needle = _mm_set1_epi8(static_cast<char>(tag));
+  size_t count = 0;
+  size_t i = 0;
+  while (size - i >= 16) {
+    // Counts matches in each byte of counts, for as many blocks of 16 as
+    // fit before a byte could overflow, then adds up the bytes.
+    size_t end = i + std::min((size - i) / 16, size_t{255}) * 16;
+    __m128i counts = _mm_setzero_si128();
+    for (; i < end; i += 16) {
+      __m128i block =
+          _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags + i));
+      // Matching bytes are all ones, i.e., -1.
+      counts = _mm_sub_epi8(counts, _mm_cmpeq_epi8(block, needle));
+    }
+    __m128i sums = _mm_sad_epu8(counts, _mm_setzero_si128());
+    count += _mm_cvtsi128_si32(sums) + _mm_extract_epi16(sums, 4);
   }
-  explicit operator const T2&() const {
-    assert(field_num == 2);
-    return storage.s2.v;
+  return count + CountTagScalar(tags + i, size - i, tag);
+}
+
+inline void FindTagSse2(const uint8_t* tags, size_t size, uint8_t tag,
+                        std::vector<size_t>* indices) {
+  const __m128i needle = _mm_set1_epi8(static_cast<char>(tag));
+  size_t i = 0;
+  for (; size - i >= 16; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags + i));
+    // One bit per matching byte.
+    uint32_t matches = _mm_movemask_epi8(_mm_cmpeq_epi8(block, needle));
+    for (; matches != 0; matches &= matches - 1) {
+      indices->push_back(i + __builtin_ctz(matches));
+    }
   }
-  explicit operator const T3&() const {
-    assert(field_num == 3);
-    return storage.s3.v;
+  FindTagScalar(tags, i, size, tag, indices);
+}
+
+inline bool AllTagSse2(const uint8_t* tags, size_t size, uint8_t tag) {
+  const __m128i needle = _mm_set1_epi8(static_cast<char>(tag));
+  size_t i = 0;
+  for (; size - i >= 16; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(tags + i));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)) != 0xffff) {
+      return false;
+    }
   }
-  explicit operator const T4&() const {
-    assert(field_num == 4);
-    return storage.s4.v;
+  return AllTagScalar(tags + i, size - i, tag);
+}
+
+// The same 32 bytes at a time, compiled for processors with AVX2 whatever
+// the compiler flags say. Only called if the processor has it.
+__attribute__((target("avx2"))) inline size_t CountTagAvx2(const uint8_t* tags,
+                                                           size_t size,
+                                                           uint8_t tag) {
+  const __m256i needle = _mm256_set1_epi8(static_cast<char>(tag));
+  size_t count = 0;
+  size_t i = 0;
+  while (size - i >= 32) {
+    size_t end = i + std::min((size - i) / 32, size_t{255}) * 32;
+    __m256i counts = _mm256_setzero_si256();
+    for (; i < end; i += 32) {
+      __m256i block =
+          _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tags + i));
+      counts = _mm256_sub_epi8(counts, _mm256_cmpeq_epi8(block, needle));
+    }
+    __m256i sums = _mm256_sad_epu8(counts, _mm256_setzero_si256());
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+             _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
   }
-  explicit operator const T5&() const {
-    assert(field_num == 5);
-    return storage.s5.v;
+  return count + CountTagScalar(tags + i, size - i, tag);
+}
+
+__attribute__((target("avx2"))) inline void FindTagAvx2(
+    const uint8_t* tags, size_t size, uint8_t tag,
+    std::vector<size_t>* indices) {
+  const __m256i needle = _mm256_set1_epi8(static_cast<char>(tag));
+  size_t i = 0;
+  for (; size - i >= 32; i += 32) {
+    __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tags + i));
+    uint32_t matches = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle));
+    for (; matches != 0; matches &= matches - 1) {
+      indices->push_back(i + __builtin_ctz(matches));
+    }
   }
-  explicit operator const T6&() const {
-    assert(field_num == 6);
-    return storage.s6.v;
+  FindTagScalar(tags, i, size, tag, indices);
+}
+
+__attribute__((target("avx2"))) inline bool AllTagAvx2(const uint8_t* tags,
+                                                       size_t size,
+                                                       uint8_t tag) {
+  const __m256i needle = _mm256_set1_epi8(static_cast<char>(tag));
+  size_t i = 0;
+  for (; size - i >= 32; i += 32) {
+    __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i*>(tags + i));
+    if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)) != -1) {
+      return false;
+    }
   }
-  explicit operator const T7&() const {
-    assert(field_num == 7);
-    return storage.s7.v;
+  return AllTagScalar(tags + i, size - i, tag);
+}
+
+inline bool HasAvx2() {
+  static const bool has_avx2 = []() {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") != 0;
+  }();
+  return has_avx2;
+}
+#endif
+
+}
+
+// The number of tags equal to tag.
+inline size_t CountTag(Span<const uint8_t> tags, uint8_t tag) {
+#if defined(ELI5_VARIANT_TAG_SCAN_X86)
+  if (internal::HasAvx2()) {
+    return internal::CountTagAvx2(tags.data, tags.size, tag);
   }
-  explicit operator const T8&() const {
-    assert(field_num == 8);
-    return storage.s8.v;
+  return internal::CountTagSse2(tags.data, tags.size, tag);
+#else
+  return internal::CountTagScalar(tags.data, tags.size, tag);
+#endif
+}
+
+// Sets counts[i] to the number of tags equal to i, for i from 0 to
+// num_tags - 1. Goes over the tags once per value, which with SIMD is
+// faster than going over them once a tag at a time for few values.
+inline void CountTags(Span<const uint8_t> tags, size_t num_tags,
+                      size_t* counts) {
+  for (size_t i = 0; i < num_tags; ++i) {
+    counts[i] = CountTag(tags, static_cast<uint8_t>(i));
   }
-  explicit operator const T9&() const {
-    assert(field_num == 9);
-    return storage.s9.v;
+}
+
+// Appends the positions of the tags equal to tag to indices, in order.
+inline void FindTag(Span<const uint8_t> tags, uint8_t tag,
+                    std::vector<size_t>* indices) {
+#if defined(ELI5_VARIANT_TAG_SCAN_X86)
+  if (internal::HasAvx2()) {
+    internal::FindTagAvx2(tags.data, tags.size, tag, indices);
+    return;
   }
-  explicit operator const T10&() const {
-    assert(field_num == 10);
-    return storage.s10.v;
+  internal::FindTagSse2(tags.data, tags.size, tag, indices);
+#else
+  internal::FindTagScalar(tags.data, 0, tags.size, tag, indices);
+#endif
+}
+
+// Whether all the tags are equal to tag. True if there are none.
+inline bool AllTagsAre(Span<const uint8_t> tags, uint8_t tag) {
+#if defined(ELI5_VARIANT_TAG_SCAN_X86)
+  if (internal::HasAvx2()) {
+    return internal::AllTagAvx2(tags.data, tags.size, tag);
   }
-  explicit operator const T11&() const {
-    assert(field_num == 11);
-    return storage.s11.v;
+  return internal::AllTagSse2(tags.data, tags.size, tag);
+#else
+  return internal::AllTagScalar(tags.data, tags.size, tag);
+#endif
+}
+
+// VariantVector
+// A sequence of values of the types Ts, like vector<Variant<Ts...>>, but
+// stored column by column: one vector per type holding the values of that
+// type in order, plus a vector of one numeric field per element saying which
+// type it is. Each value takes up its own size rather than the size of the
+// largest type, and all the values of one type are contiguous, so code can
+// work on, e.g., all the doubles in a tight loop with no branches:
+//
+//  VariantVector<int64_t, double> vv;
+//  vv.push_back(1);
+//  vv.push_back(2.5);
+//  double sum = 0;
+//  for (double d : vv.Column<double>()) {
+//    sum += d;
+//  }
+//
+// The elements can also be visited in the order they were added, with
+// ForEach. There is no indexed access to single elements: the position of
+// element i in its column is the number of earlier elements of the same type,
+// which would take a scan of the numeric fields to find.
+
+template <typename... Ts>
+class VariantVector {
+ public:
+  typedef Variant<Ts...> value_type;
+  typedef typename value_type::Tag Tag;
+
+  size_t size() const { return tags_.size(); }
+  bool empty() const { return tags_.empty(); }
+
+  void clear() {
+    tags_.clear();
+    ClearColumns(std::index_sequence_for<Ts...>());
   }
-  explicit operator const T12&() const {
-    assert(field_num == 12);
-    return storage.s12.v;
+
+  // Appends a value of any of the types, or of a type that converts to one
+  // of them, picked as by Variant's constructor.
+  template <typename U, typename T = internal::ConvertedType<U&&, Ts...>>
+  void push_back(U&& value) { emplace_back<T>(std::forward<U>(value)); }
+
+  // Appends the value held by a variant, which must hold one.
+  void push_back(const value_type& v) {
+    assert(v.field_num != value_type::kNoValue);
+    PushBack(v, std::index_sequence_for<Ts...>());
   }
-  explicit operator const T13&() const {
-    assert(field_num == 13);
-    return storage.s13.v;
+
+  // Appends a T built from args.
+  template <typename T, typename... Args>
+  T& emplace_back(Args&&... args) {
+    std::vector<T>& column = std::get<IndexOf<T>()>(columns_);
+    column.emplace_back(std::forward<Args>(args)...);
+    tags_.push_back(IndexOf<T>());
+    return column.back();
   }
-  explicit operator const T14&() const {
-    assert(field_num == 14);
-    return storage.s14.v;
+
+  // The numeric field of each element: the position of its type in Ts.
+  Span<const Tag> tags() const {
+    return {tags_.data(), tags_.size()};
   }
-  explicit operator const T15&() const {
-    assert(field_num == 15);
-    return storage.s15.v;
+
+  // All the values of type T, in the order they were added.
+  template <typename T>
+  Span<const T> Column() const {
+    const std::vector<T>& column = std::get<IndexOf<T>()>(columns_);
+    return {column.data(), column.size()};
   }
 
-  // Applies a function to the stored value. If we have N types in the variant
-  // we will need N functions to be passed in, so that we can pick the
-  // appropriate
-  // one and invoke it. We require that the N functions be bundled up in a
-  // struct
-  // or class, with name 'Run', and taking a single parameter which is the
-  // type to which that function should be applied.
-  template <typename Dispatcher>
-  void DispatchUsing(Dispatcher& dispatcher) const {
-    switch (field_num) {
-      case 0:
-        DispatchOneValue(storage.s0.v, dispatcher);
-        break;
-      case 1:
-        DispatchOneValue(storage.s1.v, dispatcher);
-        break;
-      case 2:
-        DispatchOneValue(storage.s2.v, dispatcher);
-        break;
-      case 3:
-        DispatchOneValue(storage.s3.v, dispatcher);
-        break;
-      case 4:
-        DispatchOneValue(storage.s4.v, dispatcher);
-        break;
-      case 5:
-        DispatchOneValue(storage.s5.v, dispatcher);
-        break;
-      case 6:
-        DispatchOneValue(storage.s6.v, dispatcher);
-        break;
-      case 7:
-        DispatchOneValue(storage.s7.v, dispatcher);
-        break;
-      case 8:
-        DispatchOneValue(storage.s8.v, dispatcher);
-        break;
-      case 9:
-        DispatchOneValue(storage.s9.v, dispatcher);
-        break;
-      case 10:
-        DispatchOneValue(storage.s10.v, dispatcher);
-        break;
-      case 11:
-        DispatchOneValue(storage.s11.v, dispatcher);
-        break;
-      case 12:
-        DispatchOneValue(storage.s12.v, dispatcher);
-        break;
-      case 13:
-        DispatchOneValue(storage.s13.v, dispatcher);
-        break;
-      case 14:
-        DispatchOneValue(storage.s14.v, dispatcher);
-        break;
-      case 15:
-        DispatchOneValue(storage.s15.v, dispatcher);
-        break;
-    }
+  // Same, but the values can be changed in place.
+  template <typename T>
+  Span<T> MutableColumn() {
+    std::vector<T>& column = std::get<IndexOf<T>()>(columns_);
+    return {column.data(), column.size()};
   }
 
-  // Check if two variants are equal. Iff the field types are same and values
-  // are equal by operator==.
-  bool operator==(const Variant& other) const {
-    if (field_num != other.field_num) {
-      return false;
-    }
-    switch (field_num) {
-      case 0:
-        return storage.s0.v == other.storage.s0.v;
-        break;
-      case 1:
-        return storage.s1.v == other.storage.s1.v;
-        break;
-      case 2:
-        return storage.s2.v == other.storage.s2.v;
-        break;
-      case 3:
-        return storage.s3.v == other.storage.s3.v;
-        break;
-      case 4:
-        return storage.s4.v == other.storage.s4.v;
-        break;
-      case 5:
-        return storage.s5.v == other.storage.s5.v;
-        break;
-      case 6:
-        return storage.s6.v == other.storage.s6.v;
-        break;
-      case 7:
-        return storage.s7.v == other.storage.s7.v;
-        break;
-      case 8:
-        return storage.s8.v == other.storage.s8.v;
-        break;
-      case 9:
-        return storage.s9.v == other.storage.s9.v;
-        break;
-      case 10:
-        return storage.s10.v == other.storage.s10.v;
-        break;
-      case 11:
-        return storage.s11.v == other.storage.s11.v;
-        break;
-      case 12:
-        return storage.s12.v == other.storage.s12.v;
-        break;
-      case 13:
-        return storage.s13.v == other.storage.s13.v;
-        break;
-      case 14:
-        return storage.s14.v == other.storage.s14.v;
-        break;
-      case 15:
-        return storage.s15.v == other.storage.s15.v;
-        break;
-    }
-    return false;
+  // The positions of the elements of type T, in order. Uses FindTag, so the
+  // variant can have at most 255 types.
+  template <typename T>
+  std::vector<size_t> IndicesOf() const {
+    std::vector<size_t> indices;
+    FindTag(tags(), IndexOf<T>(), &indices);
+    return indices;
   }
 
-  // Inequality. Literally negation of equality.
-  bool operator!=(const Variant& other) const { return !(*this == other); }
+  // Calls dispatcher.Run on each element in the order they were added, like
+  // calling DispatchUsing on each element of a vector<Variant<Ts...>>. Keeps
+  // one position per column and jumps through a table of functions, one per
+  // type, indexed with the element's numeric field.
+  template <typename Dispatcher>
+  void ForEach(Dispatcher&& dispatcher) const {
+    ForEach(dispatcher, std::index_sequence_for<Ts...>());
+  }
 
-  // Dispatch function that will call the dispatch method within the
-  // user's dispatcher. We need this indirection so that we get a chance
-  // make the default dispatchers participate in overload resolution.
-  // If the user makes a two-element variant and the supplied dispatcher
-  // supplies functions for those two types, we want the default dispatching
-  // functions to be used for the switch cases 3 through max.
-  template <typename T, typename Dispatcher>
-  void DispatchOneValue(const T& v, Dispatcher& dispatcher) const {
-    dispatcher.Run(v);
+  // The position of T among the types.
+  template <typename T>
+  static constexpr size_t IndexOf() {
+    return internal::IndexOf<T, Ts...>::index;
   }
 
-  // Overloads that will match for the template params that are set to
-  // defaults. i.e., when user create a variant with fewer than max
-  // elements.
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES0& v, Dispatcher& dispatcher) const {}
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES1& v, Dispatcher& dispatcher) const {}
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES2& v, Dispatcher& dispatcher) const {}
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES3& v, Dispatcher& dispatcher) const {}
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES4& v, Dispatcher& dispatcher) const {}
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES5& v, Dispatcher& dispatcher) const {}
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES6& v, Dispatcher& dispatcher) const {}
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES7& v, Dispatcher& dispatcher) const {}
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES8& v, Dispatcher& dispatcher) const {}
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES9& v, Dispatcher& dispatcher) const {}
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES10& v, Dispatcher& dispatcher) const {
+ private:
+  template <size_t I>
+  static void PushBackAt(VariantVector* vv, const value_type& v) {
+    std::get<I>(vv->columns_).push_back(v.template UncheckedGet<I>());
   }
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES11& v, Dispatcher& dispatcher) const {
+
+  template <size_t... Is>
+  void PushBack(const value_type& v, std::index_sequence<Is...>) {
+    typedef void (*Function)(VariantVector*, const value_type&);
+    static constexpr Function functions[] = {&PushBackAt<Is>...};
+    functions[v.field_num](this, v);
+    tags_.push_back(v.field_num);
   }
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES12& v, Dispatcher& dispatcher) const {
+
+  template <size_t... Is>
+  void ClearColumns(std::index_sequence<Is...>) {
+    int unused[] = {(std::get<Is>(columns_).clear(), 0)...};
+    static_cast<void>(unused);
   }
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES13& v, Dispatcher& dispatcher) const {
+
+  template <size_t I, typename Dispatcher>
+  static void RunAt(const VariantVector& vv, size_t* positions,
+                    Dispatcher& dispatcher) {
+    dispatcher.Run(std::get<I>(vv.columns_)[positions[I]++]);
   }
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES14& v, Dispatcher& dispatcher) const {
+
+  template <typename Dispatcher, size_t... Is>
+  void ForEach(Dispatcher& dispatcher, std::index_sequence<Is...>) const {
+    typedef void (*Function)(const VariantVector&, size_t*, Dispatcher&);
+    static constexpr Function functions[] = {&RunAt<Is, Dispatcher>...};
+    size_t positions[sizeof...(Ts)] = {};
+    for (Tag tag : tags_) {
+      functions[tag](*this, positions, dispatcher);
+    }
   }
-  template <typename Dispatcher>
-  void DispatchOneValue(const internal::ES15& v, Dispatcher& dispatcher) const {
-  }
-
-  // Make the template params available. Used by the indexed getter
-  // utility below.
-  typedef T0 ValueType0;
-  typedef T1 ValueType1;
-  typedef T2 ValueType2;
-  typedef T3 ValueType3;
-  typedef T4 ValueType4;
-  typedef T5 ValueType5;
-  typedef T6 ValueType6;
-  typedef T7 ValueType7;
-  typedef T8 ValueType8;
-  typedef T9 ValueType9;
-  typedef T10 ValueType10;
-  typedef T11 ValueType11;
-  typedef T12 ValueType12;
-  typedef T13 ValueType13;
-  typedef T14 ValueType14;
-  typedef T15 ValueType15;
-};
-namespace internal {
 
-// TypeHelper is set of structs so that we can do TypeHelper<0,
-// Variant>::value_type and get 0th type of the variant etc. We need this so
-// that we can express all the return values of the indexed getter function
-// using the same literal program text.
-//
-// These structs are the reason why we made the templates types available as
-// typedefs named ValueType0 etc in the Variant class above.
-template <int N, typename VariantType>
-struct TypeHelper {
-  // This should never be used. Only the specializations below will be used.
+  std::vector<Tag> tags_;
+  std::tuple<std::vector<Ts>...> columns_;
 };
 
-// Specialization of TypeHelper that creates a typedef for the 0th type of the
-// variant.
-template <typename VariantType>
-struct TypeHelper<0, VariantType> {
-  typedef typename VariantType::ValueType0 value_type;
-};
-template <typename VariantType>
-struct TypeHelper<1, VariantType> {
-  typedef typename VariantType::ValueType1 value_type;
-};
-template <typename VariantType>
-struct TypeHelper<2, VariantType> {
-  typedef typename VariantType::ValueType2 value_type;
-};
-template <typename VariantType>
-struct TypeHelper<3, VariantType> {
-  typedef typename VariantType::ValueType3 value_type;
-};
-template <typename VariantType>
-struct TypeHelper<4, VariantType> {
-  typedef typename VariantType::ValueType4 value_type;
-};
-template <typename VariantType>
-struct TypeHelper<5, VariantType> {
-  typedef typename VariantType::ValueType5 value_type;
-};
-template <typename VariantType>
-struct TypeHelper<6, VariantType> {
-  typedef typename VariantType::ValueType6 value_type;
-};
+// Helpers for DispatchAll, below.
+namespace internal {
+
 template <typename VariantType>
-struct TypeHelper<7, VariantType> {
-  typedef typename VariantType::ValueType7 value_type;
-};
+const VariantType& AsVariant(const VariantType& v) { return v; }
+
 template <typename VariantType>
-struct TypeHelper<8, VariantType> {
-  typedef typename VariantType::ValueType8 value_type;
+const VariantType& AsVariant(const VariantType* v) { return *v; }
+
+// Runs the dispatcher on groups[starts[I]] to groups[starts[I + 1] - 1],
+// which are all of the Ith type, for each type I. groups has either the
+// variants or pointers to them.
+template <size_t I, typename Iterator, typename Dispatcher>
+void DispatchGroup(Iterator group, Iterator end, Dispatcher& dispatcher) {
+  for (; group != end; ++group) {
+    dispatcher.Run(AsVariant(*group).template UncheckedGet<I>());
+  }
+}
+
+template <typename Iterator, typename Dispatcher, size_t... Is>
+void DispatchGroups(Iterator groups, const size_t* starts,
+                    Dispatcher& dispatcher, std::index_sequence<Is...>) {
+  int unused[] = {(DispatchGroup<Is>(groups + starts[Is],
+                                     groups + starts[Is + 1], dispatcher),
+                   0)...};
+  static_cast<void>(unused);
+}
+
+// Counts the variants in the range holding each type, and sets starts[i]
+// to where the variants of the ith type go when grouped by type. The last
+// group, starting at starts[kNumTypes], is of variants holding nothing.
+template <typename VariantType, typename Range>
+void GroupStarts(const Range& range, size_t* starts) {
+  size_t counts[VariantType::kNumTypes + 1] = {};
+  for (const VariantType& v : range) {
+    ++counts[v.field_num];
+  }
+  starts[0] = 0;
+  for (size_t i = 0; i <= VariantType::kNumTypes; ++i) {
+    starts[i + 1] = starts[i] + counts[i];
+  }
+}
+
+}
+
+// DispatchAll
+// Calls dispatcher.Run on each of a range of variants, like calling
+// DispatchUsing on each in turn, but a type at a time: first on all the
+// variants holding the first type, then on all holding the second, and so
+// on. Going through a mix of types one variant at a time, the processor
+// can't predict which Run comes next and pays for a misprediction on most
+// of them; a type at a time, each Run is called in a loop it predicts.
+//
+//  vector<Variant<int, double>> vs{1, 2.5, 3};
+//  DispatchAll(vs, dispatcher);  // Runs on 1, then 3, then 2.5.
+//
+// The range isn't changed, and the variants of each type are dispatched in
+// their order in the range. Grouping them allocates an array of pointers.
+// Variants holding nothing are skipped.
+template <typename Range, typename Dispatcher>
+void DispatchAll(const Range& range, Dispatcher&& dispatcher) {
+  typedef std::decay_t<decltype(*std::begin(range))> VariantType;
+  constexpr size_t kNumTypes = VariantType::kNumTypes;
+  size_t starts[kNumTypes + 2];
+  internal::GroupStarts<VariantType>(range, starts);
+  // A counting sort of pointers to the variants, which keeps the variants
+  // of each type in range order.
+  std::vector<const VariantType*> groups(starts[kNumTypes + 1]);
+  size_t next[kNumTypes + 1];
+  std::copy(starts, starts + kNumTypes + 1, next);
+  for (const VariantType& v : range) {
+    groups[next[v.field_num]++] = &v;
+  }
+  internal::DispatchGroups(groups.data(), starts, dispatcher,
+                           std::make_index_sequence<kNumTypes>());
+}
+
+// Same, but first reorders the range in place so that the variants of each
+// type are next to each other, and then dispatches straight from it. It
+// needs no memory, but the variants of each type end up, and are dispatched,
+// in no particular order. A range that is gone through more than once stays
+// grouped, so later calls only read it. The range must have random access
+// iterators.
+template <typename Range, typename Dispatcher>
+void DispatchAllReordering(Range& range, Dispatcher&& dispatcher) {
+  typedef std::decay_t<decltype(*std::begin(range))> VariantType;
+  constexpr size_t kNumTypes = VariantType::kNumTypes;
+  size_t starts[kNumTypes + 2];
+  internal::GroupStarts<VariantType>(range, starts);
+  // Swaps each variant into its type's group, one group at a time, as in an
+  // American flag sort. next[i] is where the next variant of the ith type
+  // goes.
+  auto begin = std::begin(range);
+  size_t next[kNumTypes + 1];
+  std::copy(starts, starts + kNumTypes + 1, next);
+  for (size_t group = 0; group <= kNumTypes; ++group) {
+    while (next[group] < starts[group + 1]) {
+      size_t field_num = begin[next[group]].field_num;
+      if (field_num == group) {
+        ++next[group];
+      } else {
+        std::swap(begin[next[group]], begin[next[field_num]++]);
+      }
+    }
+  }
+  internal::DispatchGroups(begin, starts, dispatcher,
+                           std::make_index_sequence<kNumTypes>());
+}
+
+// Encoding
+// A binary encoding of variants that can be read in place, e.g., from a
+// memory-mapped file, without building variants or copying strings.
+//
+// A variant is encoded as its numeric field, in as many bytes as its Tag
+// (one for up to 255 types), followed by its value as VariantCodec encodes
+// it. A sequence of variants starts with a 16 byte EncodedVariantsHeader.
+// Numbers are in the byte order of the machine that wrote them; the header
+// says which one that was, and readers refuse the other.
+//
+//  vector<Variant<int64_t, double, string>> vs{int64_t{1}, 2.5, "three"};
+//  string encoded;
+//  EncodeVariants(vs, &encoded);
+//  VariantReader<Variant<int64_t, double, string>> reader;
+//  if (!reader.Open(encoded.data(), encoded.size()) ||
+//      !reader.ForEach(dispatcher)) {
+//    // reader.error() says what is wrong with the data.
+//  }
+//
+// The dispatcher's Run gets each value as its VariantCodec<T>::View: numbers
+// as themselves and strings as a Span<const char> into the buffer.
+
+// VariantCodec<T> writes and reads the values of type T:
+//
+//   // Appends the encoded value to out.
+//   static void Append(const T& value, std::string* out);
+//   // Reads a value from [data, end) into view. Returns the end of the
+//   // value, or nullptr if the data is too short or malformed.
+//   static const char* Read(const char* data, const char* end, View* view);
+//   // Makes a T from a view, copying what the view points to.
+//   static T ToValue(const View& view);
+//
+// View, which must be default-constructible, is what the reader hands out.
+// Specialize it to encode other types.
+template <typename T, typename Enable = void>
+struct VariantCodec;
+
+// Numbers and enums are encoded as their bytes, so they take a fixed width.
+template <typename T>
+struct VariantCodec<T, std::enable_if_t<std::is_arithmetic<T>::value ||
+                                        std::is_enum<T>::value>> {
+  typedef T View;
+
+  static void Append(const T& value, std::string* out) {
+    out->append(reinterpret_cast<const char*>(&value), sizeof(value));
+  }
+
+  static const char* Read(const char* data, const char* end, View* view) {
+    if (static_cast<size_t>(end - data) < sizeof(T)) {
+      return nullptr;
+    }
+    memcpy(view, data, sizeof(T));
+    return data + sizeof(T);
+  }
+
+  static T ToValue(const View& view) { return view; }
 };
-template <typename VariantType>
-struct TypeHelper<9, VariantType> {
-  typedef typename VariantType::ValueType9 value_type;
+
+// A bool takes one byte, which must be 0 or 1.
+template <>
+struct VariantCodec<bool> {
+  typedef bool View;
+
+  static void Append(bool value, std::string* out) {
+    out->push_back(value ? 1 : 0);
+  }
+
+  static const char* Read(const char* data, const char* end, View* view) {
+    if (data == end || (*data != 0 && *data != 1)) {
+      return nullptr;
+    }
+    *view = *data == 1;
+    return data + 1;
+  }
+
+  static bool ToValue(const View& view) { return view; }
 };
-template <typename VariantType>
-struct TypeHelper<10, VariantType> {
-  typedef typename VariantType::ValueType10 value_type;
+
+// A string is encoded as its size, in 4 bytes, followed by its characters.
+template <>
+struct VariantCodec<std::string> {
+  typedef Span<const char> View;
+
+  static void Append(const std::string& value, std::string* out) {
+    assert(value.size() <= UINT32_MAX);
+    uint32_t size = value.size();
+    out->append(reinterpret_cast<const char*>(&size), sizeof(size));
+    out->append(value);
+  }
+
+  static const char* Read(const char* data, const char* end, View* view) {
+    uint32_t size;
+    data = VariantCodec<uint32_t>::Read(data, end, &size);
+    if (data == nullptr || static_cast<size_t>(end - data) < size) {
+      return nullptr;
+    }
+    *view = {data, size};
+    return data + size;
+  }
+
+  static std::string ToValue(const View& view) {
+    return std::string(view.data, view.size);
+  }
 };
-template <typename VariantType>
-struct TypeHelper<11, VariantType> {
-  typedef typename VariantType::ValueType11 value_type;
+
+// The start of an encoded sequence of variants.
+struct EncodedVariantsHeader {
+  // "EL5V" when read in the byte order of the machine reading it.
+  static constexpr uint32_t kMagic = 0x56354c45;
+  static constexpr uint32_t kSwappedMagic = 0x454c3556;
+  // Incremented when the encoding changes in a way old readers can't read.
+  static constexpr uint8_t kVersion = 1;
+
+  uint32_t magic = kMagic;
+  uint8_t version = kVersion;
+  // The size of the numeric field and the number of types of the variants,
+  // so that readers can check that they were written as the same type.
+  uint8_t tag_size = 0;
+  uint16_t num_types = 0;
+  // The number of variants that follow.
+  uint64_t num_variants = 0;
 };
-template <typename VariantType>
-struct TypeHelper<12, VariantType> {
-  typedef typename VariantType::ValueType12 value_type;
+
+static_assert(sizeof(EncodedVariantsHeader) == 16,
+              "EncodedVariantsHeader has padding");
+
+namespace internal {
+
+// Appends the encodings of the values it is dispatched on.
+struct AppendValue {
+  std::string* out;
+
+  template <typename T>
+  void Run(const T& value) { VariantCodec<T>::Append(value, out); }
 };
-template <typename VariantType>
-struct TypeHelper<13, VariantType> {
-  typedef typename VariantType::ValueType13 value_type;
+
+// What VariantReader does with the views of the values it reads: Take<I>
+// gets the view of a value of the Ith type.
+template <typename Dispatcher>
+struct RunOnView {
+  Dispatcher& dispatcher;
+
+  template <size_t I, typename View>
+  void Take(const View& view) { dispatcher.Run(view); }
 };
-template <typename VariantType>
-struct TypeHelper<14, VariantType> {
-  typedef typename VariantType::ValueType14 value_type;
+
+template <typename... Ts>
+struct AppendValueOf {
+  std::vector<Variant<Ts...>>* vs;
+
+  template <size_t I, typename View>
+  void Take(const View& view) {
+    typedef TypeAt<I, Ts...> T;
+    vs->push_back(Variant<Ts...>(VariantCodec<T>::ToValue(view)));
+  }
 };
+
+}
+
+// Appends the encoding of v, which must hold a value, to out.
+template <typename... Ts>
+void AppendEncoded(const Variant<Ts...>& v, std::string* out) {
+  typedef typename Variant<Ts...>::Tag Tag;
+  assert(v.field_num != v.kNoValue);
+  Tag tag = v.field_num;
+  out->append(reinterpret_cast<const char*>(&tag), sizeof(tag));
+  v.DispatchUsing(internal::AppendValue{out});
+}
+
+// Appends a header and the encodings of vs to out.
+template <typename... Ts>
+void EncodeVariants(const std::vector<Variant<Ts...>>& vs, std::string* out) {
+  EncodedVariantsHeader header;
+  header.tag_size = sizeof(typename Variant<Ts...>::Tag);
+  header.num_types = sizeof...(Ts);
+  header.num_variants = vs.size();
+  out->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  for (const Variant<Ts...>& v : vs) {
+    AppendEncoded(v, out);
+  }
+}
+
+// VariantReader
+// Reads variants encoded by EncodeVariants, in order, handing out views of
+// their values. The buffer must outlive the reader and the views.
 template <typename VariantType>
-struct TypeHelper<15, VariantType> {
-  typedef typename VariantType::ValueType15 value_type;
+class VariantReader;
+
+template <typename... Ts>
+class VariantReader<Variant<Ts...>> {
+ public:
+  typedef typename Variant<Ts...>::Tag Tag;
+
+  // Starts reading the variants in [data, data + size). Returns false, and
+  // sets error(), if it doesn't start with a header for Variant<Ts...>.
+  bool Open(const char* data, size_t size) {
+    pos_ = data;
+    end_ = data + size;
+    num_left_ = 0;
+    error_.clear();
+    EncodedVariantsHeader header;
+    if (size < sizeof(header)) {
+      return Fail("too short for a header");
+    }
+    memcpy(&header, data, sizeof(header));
+    if (header.magic != EncodedVariantsHeader::kMagic) {
+      return Fail(header.magic == EncodedVariantsHeader::kSwappedMagic
+                      ? "written with the other byte order"
+                      : "not encoded variants");
+    }
+    // Only one version has ever been written. Accept older ones only once
+    // there is an older format to read.
+    if (header.version != EncodedVariantsHeader::kVersion) {
+      return Fail("unsupported version " + std::to_string(header.version));
+    }
+    if (header.tag_size != sizeof(Tag) || header.num_types != sizeof...(Ts)) {
+      return Fail("written for a variant with " +
+                  std::to_string(header.num_types) + " types");
+    }
+    pos_ += sizeof(header);
+    num_left_ = header.num_variants;
+    size_ = header.num_variants;
+    return true;
+  }
+
+  // The number of variants, as the header says.
+  uint64_t size() const { return size_; }
+
+  // Reads the next variant and calls dispatcher.Run with a view of its
+  // value. Returns false when there are none left, or when the data is
+  // malformed, in which case error() says how.
+  template <typename Dispatcher>
+  bool Next(Dispatcher&& dispatcher) {
+    internal::RunOnView<Dispatcher> sink{dispatcher};
+    return Next(sink, std::index_sequence_for<Ts...>());
+  }
+
+  // Calls dispatcher.Run on views of all the variants left. Returns false
+  // if the data is malformed.
+  template <typename Dispatcher>
+  bool ForEach(Dispatcher&& dispatcher) {
+    internal::RunOnView<Dispatcher> sink{dispatcher};
+    while (Next(sink, std::index_sequence_for<Ts...>())) {
+    }
+    return error_.empty();
+  }
+
+  // Empty unless Open or Next found the data malformed.
+  const std::string& error() const { return error_; }
+
+ private:
+  template <typename... Us>
+  friend bool DecodeVariants(const char* data, size_t size,
+                             std::vector<Variant<Us...>>* vs,
+                             std::string* error);
+
+  // Reads the value of the Ith type and passes its view to sink.Take<I>.
+  template <size_t I, typename Sink>
+  static const char* ReadAt(const char* data, const char* end, Sink& sink) {
+    typedef VariantCodec<internal::TypeAt<I, Ts...>> Codec;
+    typename Codec::View view;
+    data = Codec::Read(data, end, &view);
+    if (data != nullptr) {
+      sink.template Take<I>(view);
+    }
+    return data;
+  }
+
+  template <typename Sink, size_t... Is>
+  bool Next(Sink& sink, std::index_sequence<Is...>) {
+    typedef const char* (*Function)(const char*, const char*, Sink&);
+    static constexpr Function functions[] = {&ReadAt<Is, Sink>...};
+    if (num_left_ == 0) {
+      if (error_.empty() && pos_ != end_) {
+        Fail("data after the last variant");
+      }
+      return false;
+    }
+    Tag tag;
+    if (static_cast<size_t>(end_ - pos_) < sizeof(tag)) {
+      return Fail("truncated");
+    }
+    memcpy(&tag, pos_, sizeof(tag));
+    if (tag >= sizeof...(Ts)) {
+      return Fail("bad numeric field " + std::to_string(tag));
+    }
+    const char* next = functions[tag](pos_ + sizeof(tag), end_, sink);
+    if (next == nullptr) {
+      return Fail("truncated or malformed value");
+    }
+    pos_ = next;
+    --num_left_;
+    return true;
+  }
+
+  // Sets the error and stops reading.
+  bool Fail(const std::string& error) {
+    error_ = "Variant encoding: " + error;
+    num_left_ = 0;
+    pos_ = end_;
+    return false;
+  }
+
+  const char* pos_ = nullptr;
+  const char* end_ = nullptr;
+  uint64_t num_left_ = 0;
+  uint64_t size_ = 0;
+  std::string error_;
 };
+
+// Reads variants encoded by EncodeVariants and appends copies of them to vs.
+// Returns false, and sets error, if the data is malformed; vs then has the
+// ones before the first malformed one.
+template <typename... Ts>
+bool DecodeVariants(const char* data, size_t size,
+                    std::vector<Variant<Ts...>>* vs, std::string* error) {
+  VariantReader<Variant<Ts...>> reader;
+  if (reader.Open(data, size)) {
+    // Every variant takes at least a byte, so a bad header can't make this
+    // reserve more than the buffer's size.
+    vs->reserve(vs->size() + std::min<uint64_t>(reader.size(), size));
+    internal::AppendValueOf<Ts...> sink{vs};
+    while (reader.Next(sink, std::index_sequence_for<Ts...>())) {
+    }
+  }
+  *error = reader.error();
+  return error->empty();
+}
+
 }
+
+namespace std {
+
+template <typename... Ts>
+struct hash<eli5::Variant<Ts...>> {
+  size_t operator()(const eli5::Variant<Ts...>& v) const { return v.Hash(); }
+};
+
 }
 #endif